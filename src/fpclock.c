@@ -22,559 +22,3362 @@ The sceleton of the daemon is based on https://github.com/jirihnidek/daemon
 by Jiri Hnidek <jiri.hnidek@tul.cz>
 */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <linux/rtc.h>
 #include <math.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/timex.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fpclock_status.h"
+
+#define DRIFT_SAMPLES 64
+#define LATENCY_BUCKETS 192 // log-linear up to 2^26 us
+#define PROM_BUCKETS 10
+#define DRIFT_MIN_INTERVAL 60.0 // seconds, shorter samples are dominated by quantization
+#define DRIFT_OUTLIER_MAD 3.0	// reject rates further than this many MADs from the median
+#define DRIFT_OUTLIER_MIN 2e-6	// but never reject within 2 ppm of the median
+#define DRIFT_TEMP_LINEAR 2.0		// degrees of temperature spread for a linear model
+#define DRIFT_TEMP_QUADRATIC 5.0	// and for a quadratic model
+#define DRIFT_TEMP_EXTRAPOLATE 15.0 // degrees the model is used beyond the measured range
+
+#define RESUME_MIN_SLEEP 2.0 // seconds of suspend detected as resume
+
+#define CTL_TIMEOUT_MS 200 // control socket client read/write timeout
+
+#define LATENCY_MIN_SAMPLES 3 // write latency samples before writes are started early
+#define APPLY_GAIN 0.5		  // weight of a new apply delay measurement
+#define APPLY_MAX 0.5		  // seconds, larger residuals are not a latency
+#define STATS_SAMPLES 20	  // RTC reads timed by --stats without a daemon
+#define FAST_RESTORE_MIN 30	  // seconds of RTC offset before -R sets the time, as -r
+
+#define LOG_RING_SLOTS 128 // power of two
+#define LOG_RECORD_LEN 500
+#define LOG_BATCH 16 // records per writev
+#define LOG_WARN 2	 // LOG() flag, kept in the log file while the RAM log holds the rest
+
+#define RAM_LOG_MAGIC 0x474c5046 // "FPLG"
+
+#define ADAPTIVE_MIN_SAMPLES 3 // drift samples before the update interval adapts
+
+#define STATE_MAGIC 0x53435046 // "FPCS"
+#define STATE_VERSION 1
+
 static int verbose = 0;
 static int forcedate = -1;
 static int running = 0;
 static int delay = 1800;
+static int precise = 0;
+static double slew_rate = 500.0;	// ppm, maximum slew rate
+static double slew_time_max = 1000; // seconds a slew may take before stepping instead
+static int step_window = 0;			// seconds after boot in which stepping is allowed, 0 = always
+static double standby_temp = NAN;	// assumed RTC temperature while powered off, NAN = unknown
+static double flash_drift = 0.5;	// ppm of drift change that is written to flash
+static int flash_max_age = 86400;	// seconds after which the drift file is rewritten anyway
+static double flash_offset = 0.2;	// seconds of offline drift error a stale flash copy may cause
+static double max_error = 0;		// seconds of RTC error tolerated between updates, 0 = fixed timeout
+static int min_interval = 300;		// bounds of the adaptive update interval
+static int max_interval = 21600;
+static double write_threshold = 0; // seconds of RTC offset below which updates skip the write
+static unsigned long rtc_writes_issued = 0;
+static unsigned long rtc_writes_skipped = 0;
 static char *conf_file_name = NULL;
 static char *pid_file_name = NULL;
 static char *log_file_name = NULL;
 static int pid_fd = -1;
 static FILE *log_stream;
-static int drift_data[10];
+
+/**
+ * \brief Drift sample, RTC offset measured interval seconds after the RTC was set
+ */
+struct drift_sample
+{
+	double time;	 // system time of the measurement
+	double offset;	 // RTC minus system time in seconds
+	double interval; // seconds since the RTC was last written
+	double temp;	 // thermal zone average in degrees Celsius, NAN if unknown
+};
+
+/**
+ * \brief Fitted drift, optionally as polynomial of the temperature
+ */
+struct drift_model
+{
+	double drift;	// seconds per second, temperature independent fit
+	int order;		// number of valid coef, 0 = no temperature model
+	double coef[3]; // seconds per second at tref, per degree, per degree^2
+	double tref;	// temperature the polynomial is centered on
+	double tmin;	// measured temperature range
+	double tmax;
+};
+
+static struct drift_sample drift_data[DRIFT_SAMPLES];
+static int drift_count = 0;
 static int drift_index = 0;
+static double rtc_last_write = 0; // system time of the last RTC write, 0 = unknown
+static time_t rtc_last_read = 0;  // last RTC reading
+static double rtc_last_read_at = 0;
+static double rtc_last_offset = 0; // RTC minus system time at the last edge measurement
+static double rtc_write_offset = 0; // RTC minus system time measured right after the last write
+static double rtc_phase_offset = 0; // RTC minus system time when its phase was last known
+static double rtc_phase_at = 0;		// system time of that, 0 = phase unknown
+static double rtc_apply_delay = 0;	// running estimate of the time a write takes to reach the RTC
+static int rtc_apply_samples = 0;
+static struct fpclock_status *status_page = NULL;
+
+/**
+ * \brief Log-linear RTC access latency histogram in microseconds
+ *
+ * Values below 8 us have a bucket each, above that every power of two is
+ * split into 8 linear buckets, so a bucket is at most 12.5 % wide.
+ */
+struct latency_hist
+{
+	unsigned long bucket[LATENCY_BUCKETS];
+	unsigned long count;
+	double sum; // seconds
+	uint64_t min_us;
+	uint64_t max_us;
+};
+
+// Prometheus buckets, filled from the log-linear buckets that end at or below them
+static const double latency_bounds[PROM_BUCKETS] = {0.001, 0.0025, 0.005, 0.01, 0.025,
+													0.05,  0.1,	   0.25,  0.5,	1.0};
+static struct latency_hist rtc_read_latency;
+static struct latency_hist rtc_write_latency;
+static unsigned long rtc_read_errors = 0;
+static unsigned long rtc_write_errors = 0;
+static unsigned long loop_wakeups = 0;
+
+/**
+ * \brief Log line queued by LOG() until the event loop writes it
+ */
+struct log_record
+{
+	time_t time; // taken at the call site
+	int warn;	 // LOG_WARN given
+	unsigned int len;
+	char text[LOG_RECORD_LEN]; // including the newline
+};
+
+// Single producer (LOG) single consumer (log_flush) ring, indexes run freely.
+static struct log_record log_ring[LOG_RING_SLOTS];
+static unsigned int log_head = 0;
+static unsigned int log_tail = 0;
+static unsigned long log_dropped = 0;
+static unsigned long log_dropped_reported = 0;
+static unsigned int log_ram_tail = 0; // records before this index are already in the RAM log
+static int log_async = 0; // 1 while the event loop drains the ring, else LOG writes through
+
+/**
+ * \brief Circular in-memory log, the file is mapped and survives the daemon
+ */
+struct ram_log
+{
+	uint32_t magic;
+	uint32_t size; // bytes of data
+	uint64_t head; // bytes ever written, data[head % size] is the next byte
+	char data[];
+};
+
+static const char *ram_log_file = "/dev/shm/fpclock.log";
+static struct ram_log *ram_log = NULL;
+static int ram_log_kb = 64; // 0 = every line goes to the log file
+static char *metrics_file = NULL; // Prometheus textfile collector output, NULL = off
+static int epoll_fd = -1;
+
+/**
+ * \brief Event loop source, registered with epoll by pointer
+ */
+struct event_source
+{
+	int fd;
+	void (*handler)(struct event_source *src, uint32_t events);
+};
+
+static struct event_source update_timer = {-1, NULL};
+static struct event_source signal_source = {-1, NULL};
+static struct event_source clock_step_timer = {-1, NULL};
+static struct event_source ctl_listener = {-1, NULL};
+static struct event_source watchdog_timer = {-1, NULL};
+
+static int notify_fd = -1; // service manager notification socket, NOTIFY_SOCKET
+static struct sockaddr_un notify_addr;
+static socklen_t notify_addr_len = 0;
+static double suspend_base = NAN; // CLOCK_BOOTTIME - CLOCK_MONOTONIC at the last check
+static double rtc_mono_base = NAN; // RTC - CLOCK_MONOTONIC at the last RTC access
 
 const char *APP = "FPClock";
 const char *app_name = "fpclock";
 const char *app_ver = "1.7";
-const char *proc_file = "/proc/stb/fp/rtc";
-const char *dev_file = "/dev/dbox/fp0";
 const char *drift_file = "/etc/fpclock.drift";
+const char *shadow_file = "/var/run/fpclock.drift"; // tmpfs copy, updated every cycle
+const char *thermal_dir = "/sys/class/thermal";
+const char *ctl_socket = "/var/run/fpclock.sock";
 
 #define FP_IOCTL_SET_RTC 0x101
 #define FP_IOCTL_GET_RTC 0x102
 
+#define RTC_EDGE_POLL_NS 5000000 // 5 ms between reads while waiting for a rollover
+#define RTC_EDGE_TIMEOUT_MS 1100
+#define RTC_EDGE_POLL_MAX_NS 50000000 // poll at most this coarse on a slow RTC
+#define RTC_EDGE_MARGIN 0.02		  // seconds of polling before a predicted rollover
+#define RTC_EDGE_UNCERTAINTY 20e-6	  // assumed drift error of the predicted phase
+#define PRECISE_MIN_OFFSET 0.05 // seconds, smaller offsets are not corrected by a precise restore
+#define SLEW_KERNEL_RATE 500.0	// ppm, rate of ADJ_OFFSET_SINGLESHOT
+#define SLEW_MAX_OFFSET 2000	// seconds, fits the microsecond offset in a 32 bit long
+
+void LOG(int print, const char *format, ...);
+void updateRTC(int saveDrift, int logMode);
+void arm_update_timer(void);
+int write_fp(int c);
+int sync_fp(int cmdline);
+
+/**
+ * \brief Append to the RAM log
+ */
+static void ram_log_append(const char *text, size_t len)
+{
+	uint32_t size = ram_log->size;
+	while (len)
+	{
+		size_t pos = ram_log->head % size;
+		size_t n = size - pos < len ? size - pos : len;
+		memcpy(ram_log->data + pos, text, n);
+		__atomic_store_n(&ram_log->head, ram_log->head + n, __ATOMIC_RELEASE);
+		text += n;
+		len -= n;
+	}
+}
+
+/**
+ * \brief Map the RAM log, an existing log of the same size is continued
+ */
+int ram_log_open(void)
+{
+	if (ram_log_kb <= 0 || ram_log)
+		return 0;
+	size_t size = (size_t)ram_log_kb * 1024;
+	size_t total = sizeof(struct ram_log) + size;
+	struct stat st;
+	int fd = open(ram_log_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		LOG(LOG_WARN, "Open %s failed: %m", ram_log_file);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != total)
+	{
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, total) < 0)
+		{
+			LOG(LOG_WARN, "Resize %s failed: %m", ram_log_file);
+			close(fd);
+			return -1;
+		}
+	}
+	void *p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		LOG(LOG_WARN, "Map %s failed: %m", ram_log_file);
+		return -1;
+	}
+	struct ram_log *rl = p;
+	if (rl->magic != RAM_LOG_MAGIC || rl->size != size)
+	{
+		memset(rl, 0, sizeof(*rl));
+		rl->size = (uint32_t)size;
+		rl->magic = RAM_LOG_MAGIC;
+	}
+	ram_log = rl;
+	return 0;
+}
+
+/**
+ * \brief Unmap the RAM log, its file stays for dumping
+ */
+void ram_log_close(void)
+{
+	if (ram_log)
+		munmap(ram_log, sizeof(struct ram_log) + ram_log->size);
+	ram_log = NULL;
+}
+
+/**
+ * \brief Print the RAM log, oldest line first
+ */
+int ram_log_dump(void)
+{
+	int fd = open(ram_log_file, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct ram_log))
+	{
+		LOG(1, "No RAM log in %s", ram_log_file);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	const struct ram_log *rl = p;
+	if (rl->magic != RAM_LOG_MAGIC || sizeof(struct ram_log) + rl->size != (size_t)st.st_size)
+	{
+		LOG(1, "Invalid RAM log %s", ram_log_file);
+		munmap(p, st.st_size);
+		return -1;
+	}
+	uint64_t head = __atomic_load_n(&rl->head, __ATOMIC_ACQUIRE);
+	size_t pos = head % rl->size;
+	if (head > rl->size)
+	{ // wrapped, skip the partly overwritten first line
+		const char *nl = memchr(rl->data + pos, '\n', rl->size - pos);
+		if (nl)
+			fwrite(nl + 1, 1, rl->data + rl->size - (nl + 1), stdout);
+	}
+	fwrite(rl->data, 1, pos, stdout);
+	fflush(stdout);
+	munmap(p, st.st_size);
+	return 0;
+}
+
+/**
+ * \brief Write all of an iovec, retrying after signals and short writes
+ * \return   0 on success, -1 on a write error
+ */
+static int log_writev_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt)
+	{
+		ssize_t n = writev(fd, iov, cnt);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; cnt && (size_t)n >= iov->iov_len; iov++, cnt--)
+			n -= iov->iov_len;
+		if (cnt)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Write queued log records in batches
+ *
+ * The tail only advances after a batch is written, on a write error the records stay queued.
+ */
+void log_flush(void)
+{
+	struct iovec iov[LOG_BATCH * 2 + 2];
+	char stamps[LOG_BATCH + 1][32];
+	char dropped[64];
+	unsigned int tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	unsigned int head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+
+	if (!log_stream)
+		return;
+	int fd = fileno(log_stream);
+	fflush(log_stream); // keep order with anything printed through stdio
+	while (tail != head)
+	{
+		int n = 0;
+		unsigned int next = tail;
+		for (int i = 0; next != head && i < LOG_BATCH; next++, i++)
+		{
+			struct log_record *rec = &log_ring[next & (LOG_RING_SLOTS - 1)];
+			struct tm tm;
+			if (gmtime_r(&rec->time, &tm))
+				strftime(stamps[n], sizeof(stamps[n]), "[%Y-%m-%dT%H:%M:%SZ] ", &tm);
+			else
+				snprintf(stamps[n], sizeof(stamps[n]), "[%s] ", APP);
+			if (ram_log)
+			{ // everything goes to RAM, only warnings to the file
+				if ((int)(next - log_ram_tail) >= 0)
+				{ // not copied by an earlier failed flush
+					ram_log_append(stamps[n], strlen(stamps[n]));
+					ram_log_append(rec->text, rec->len);
+					log_ram_tail = next + 1;
+				}
+				if (!rec->warn)
+					continue;
+			}
+			iov[2 * n].iov_base = stamps[n];
+			iov[2 * n].iov_len = strlen(stamps[n]);
+			iov[2 * n + 1].iov_base = rec->text;
+			iov[2 * n + 1].iov_len = rec->len;
+			n++;
+		}
+		int cnt = 2 * n;
+		unsigned long lost = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+		if (lost != log_dropped_reported)
+		{
+			snprintf(stamps[n], sizeof(stamps[n]), "[%s] ", APP);
+			iov[cnt].iov_base = stamps[n];
+			iov[cnt++].iov_len = strlen(stamps[n]);
+			iov[cnt].iov_base = dropped;
+			iov[cnt++].iov_len = snprintf(dropped, sizeof(dropped), "%lu log lines dropped\n",
+										  lost - log_dropped_reported);
+		}
+		if (log_writev_all(fd, iov, cnt) < 0)
+			return; // keep the batch queued for the next flush
+		log_dropped_reported = lost;
+		tail = next;
+		__atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
 /**
  * \brief Log helper function
- * \param    print  0 = print to file if possible / 1 = print to console
+ * \param    print  0 = print to file if possible / 1 = print to console, LOG_WARN may be added
  * \param    format  printf format
+ *
+ * File output is queued and written by the event loop, so logging never waits for the disk.
+ * With the RAM log open only LOG_WARN lines reach the file.
  */
 void LOG(int print, const char *format, ...)
 {
-	char buf[2048];
-	char timebuf[50];
 	va_list other_args;
-	time_t t;
-	struct tm *tm;
-	va_start(other_args, format);
-	vsnprintf(buf, sizeof(buf), format, other_args);
-	va_end(other_args);
 
-	if (print)
+	if (print & 1)
 	{
+		char buf[2048];
+		va_start(other_args, format);
+		vsnprintf(buf, sizeof(buf), format, other_args);
+		va_end(other_args);
 		printf("[%s] %s\n", APP, buf);
 		return;
 	}
 
-	time(&t);
-	tm = gmtime(&t);
-
-	if (tm)
-	{
-		strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", tm);
-		fprintf(log_stream, "[%s] %s\n", timebuf, buf);
-	}
-	else
+	unsigned int head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
 	{
-		fprintf(log_stream, "[%s] %s\n", APP, buf);
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+		return;
 	}
-	fflush(log_stream);
+	struct log_record *rec = &log_ring[head & (LOG_RING_SLOTS - 1)];
+	rec->time = time(NULL);
+	rec->warn = (print & LOG_WARN) != 0;
+	va_start(other_args, format);
+	int len = vsnprintf(rec->text, sizeof(rec->text) - 1, format, other_args);
+	va_end(other_args);
+	if (len < 0)
+		len = 0;
+	else if (len > (int)sizeof(rec->text) - 2)
+		len = sizeof(rec->text) - 2; // truncated
+	rec->text[len++] = '\n';
+	rec->len = len;
+	__atomic_store_n(&log_head, head + 1, __ATOMIC_RELEASE);
+
+	if (!log_async)
+		log_flush();
+}
+
+/**
+ * \brief Current time of a clock as double
+ * \param    clk   clock id
+ */
+double clock_now(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
 // drift functions
 
 /**
- * \brief add value to drift array
- * \param    drift  new drift value
+ * \brief Average temperature of all thermal zones in degrees Celsius
+ * \return   NAN if no thermal zone can be read
  */
-void add_drift(int drift)
+double read_temperature(void)
 {
-	if (drift != 0)
+	char path[300], buf[32];
+	double sum = 0;
+	int n = 0;
+	DIR *dir = opendir(thermal_dir);
+	if (!dir)
+		return NAN;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL)
 	{
-		drift_data[drift_index] = drift;
-		drift_index++;
-		if (drift_index > 9)
-			drift_index = 0;
+		if (strncmp(de->d_name, "thermal_zone", 12) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/temp", thermal_dir, de->d_name);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		ssize_t len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		buf[len] = 0;
+		sum += atof(buf) / 1000.0; // millidegrees
+		n++;
 	}
+	closedir(dir);
+	return n ? sum / n : NAN;
+}
+
+/**
+ * \brief add sample to drift ring buffer
+ * \param    offset    RTC minus system time in seconds
+ * \param    interval  seconds since the RTC was last written
+ */
+void add_drift(double offset, double interval)
+{
+	if (interval < DRIFT_MIN_INTERVAL)
+		return;
+	drift_data[drift_index].time = clock_now(CLOCK_REALTIME);
+	drift_data[drift_index].offset = offset;
+	drift_data[drift_index].interval = interval;
+	drift_data[drift_index].temp = read_temperature();
+	drift_index = (drift_index + 1) % DRIFT_SAMPLES;
+	if (drift_count < DRIFT_SAMPLES)
+		drift_count++;
 }
+
 /**
  * \brief qsort compare function
  * \param   a value a
  * \param   b value b
  */
-int cmpfunc(const void *a, const void *b) { return (*(int *)a - *(int *)b); }
+int cmpfunc(const void *a, const void *b)
+{
+	double d = *(const double *)a - *(const double *)b;
+	return (d > 0) - (d < 0);
+}
 
 /**
- * \brief Get calculated drift value
+ * \brief Median of a scratch array, sorts it in place
  */
-double calc_drift(void)
+static double median(double *v, int n)
 {
-	qsort(drift_data, 10, sizeof(int), cmpfunc);
-	double median = (double)(drift_data[(9) / 2] + drift_data[5]) / 2.0;
-	return median / (double)delay; // calculate drift value per second
+	qsort(v, n, sizeof(double), cmpfunc);
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2.0;
 }
 
 /**
- * \brief Get drift delta in seconds from file
+ * \brief Solve the n x n normal equations m * x = v by Gaussian elimination
+ * \return   0 on success, -1 if the system is singular
  */
-int get_drift_seconds(int rtctime)
+static int solve_normal(double m[3][3], double v[3], double x[3], int n)
 {
-	FILE *f = fopen(drift_file, "r");
-	if (f)
+	for (int c = 0; c < n; c++)
 	{
-		double drift;
-		int lastsave;
-		if (fscanf(f, "%d:%lf", &lastsave, &drift) != 2)
+		int p = c;
+		for (int r = c + 1; r < n; r++)
+			if (fabs(m[r][c]) > fabs(m[p][c]))
+				p = r;
+		if (fabs(m[p][c]) < 1e-12 * fabs(m[0][0]) || m[p][c] == 0)
+			return -1;
+		for (int k = 0; k < n; k++)
 		{
-			drift = 0;
-			lastsave = 0;
-			LOG(0, "Read %s failed: %m", drift_file);
+			double t = m[c][k];
+			m[c][k] = m[p][k];
+			m[p][k] = t;
 		}
-		fclose(f);
-
-		if (drift != 0 && lastsave != 0)
+		double t = v[c];
+		v[c] = v[p];
+		v[p] = t;
+		for (int r = c + 1; r < n; r++)
 		{
-			int driftseconds = (int)((double)(rtctime - lastsave) * drift);
-			if (verbose)
-			{
-				LOG(0, "FP RC drift:%f lastsave:%d offline seconds:%d drift seconds:%d", drift,
-					lastsave, rtctime - lastsave, driftseconds);
-			}
-			return driftseconds;
+			double f = m[r][c] / m[c][c];
+			for (int k = c; k < n; k++)
+				m[r][k] -= f * m[c][k];
+			v[r] -= f * v[c];
 		}
 	}
-	else
-		LOG(0, "File %s not exists", drift_file);
-
+	for (int c = n - 1; c >= 0; c--)
+	{
+		x[c] = v[c];
+		for (int k = c + 1; k < n; k++)
+			x[c] -= m[c][k] * x[k];
+		x[c] /= m[c][c];
+	}
 	return 0;
 }
 
 /**
- * \brief Get epoch from RTC
+ * \brief Drift of a model at a temperature in seconds per second
+ * \param    temp   degrees Celsius, NAN for the temperature independent value
  */
-time_t getRTC(void)
+double drift_model_at(const struct drift_model *model, double temp)
 {
-	time_t rtc_time = 0;
-	FILE *f = fopen(proc_file, "r");
-	if (f)
-	{
-		unsigned int tmp;
-		if (fscanf(f, "%u", &tmp) != 1)
-			LOG(0, "Read %s failed: %m", proc_file);
-		else
-#ifdef HAVE_NO_RTC
-			rtc_time = 0; // Sorry no RTC
-#else
-			rtc_time = tmp;
-#endif
-		fclose(f);
-	}
-	else
+	if (!model->order || isnan(temp))
+		return model->drift;
+	// keep extrapolation of the polynomial near the measured range
+	if (temp < model->tmin - DRIFT_TEMP_EXTRAPOLATE)
+		temp = model->tmin - DRIFT_TEMP_EXTRAPOLATE;
+	if (temp > model->tmax + DRIFT_TEMP_EXTRAPOLATE)
+		temp = model->tmax + DRIFT_TEMP_EXTRAPOLATE;
+	double x = temp - model->tref;
+	double drift = 0;
+	for (int i = model->order - 1; i >= 0; i--)
+		drift = drift * x + model->coef[i];
+	return drift;
+}
+
+/**
+ * \brief Least squares fit of the drift model to the kept samples
+ * \param    keep   nonzero for samples used by the fit
+ *
+ * Each sample is offset = drift * interval, fitted through the origin, which
+ * weights long intervals by interval^2. When the samples cover enough of a
+ * temperature range, drift is additionally fitted as a linear or quadratic
+ * polynomial of the temperature.
+ */
+static void drift_fit(struct drift_model *model, const char *keep)
+{
+	double sum_os = 0, sum_ss = 0, sum_t = 0;
+	int n = drift_count, nt = 0;
+
+	memset(model, 0, sizeof(*model));
+	model->tmin = INFINITY;
+	model->tmax = -INFINITY;
+	for (int i = 0; i < n; i++)
 	{
-		if (verbose)
+		const struct drift_sample *d = &drift_data[i];
+		if (!keep[i])
+			continue;
+		sum_os += d->offset * d->interval;
+		sum_ss += d->interval * d->interval;
+		if (!isnan(d->temp))
 		{
-			LOG(0, "%s not exists", proc_file);
+			sum_t += d->temp;
+			nt++;
+			if (d->temp < model->tmin)
+				model->tmin = d->temp;
+			if (d->temp > model->tmax)
+				model->tmax = d->temp;
 		}
+	}
+	model->drift = sum_ss > 0 ? sum_os / sum_ss : 0;
+
+	// offset = interval * (c0 + c1 * x + c2 * x^2) with x = temp - tref
+	double spread = model->tmax - model->tmin;
+	int order = 0;
+	if (nt >= 5 && spread >= DRIFT_TEMP_QUADRATIC)
+		order = 3;
+	else if (nt >= 3 && spread >= DRIFT_TEMP_LINEAR)
+		order = 2;
+	if (!order)
+		return;
 
-		int fd = open(dev_file, O_RDWR);
-		if (fd >= 0)
-		{
-			if (ioctl(fd, FP_IOCTL_GET_RTC, (void *)&rtc_time) < 0)
-				LOG(0, "FP_IOCTL_GET_RTC failed: %m");
-			close(fd);
-		}
-		else
+	double m[3][3] = {{0}}, v[3] = {0};
+	model->tref = sum_t / nt;
+	for (int i = 0; i < n; i++)
+	{
+		const struct drift_sample *d = &drift_data[i];
+		double col[3];
+		if (!keep[i] || isnan(d->temp))
+			continue;
+		double x = d->temp - model->tref;
+		col[0] = d->interval;
+		col[1] = d->interval * x;
+		col[2] = d->interval * x * x;
+		for (int r = 0; r < order; r++)
 		{
-			if (verbose)
-			{
-				LOG(0, "%s not exists", dev_file);
-			}
+			for (int c = 0; c < order; c++)
+				m[r][c] += col[r] * col[c];
+			v[r] += col[r] * d->offset;
 		}
 	}
-	return rtc_time;
+	if (solve_normal(m, v, model->coef, order) == 0)
+		model->order = order;
 }
 
 /**
- * \brief Set epoch to RTC
- * \param    time   New epoch time value.
+ * \brief Fit the drift model to the sample ring
+ *
+ * All samples are fitted first, then samples whose residual rate against that
+ * fit is an outlier by median absolute deviation are dropped and the rest are
+ * fitted again, twice. Rejecting on the residuals of the temperature model keeps
+ * samples from another temperature regime, which a flat median would drop.
  */
-void setRTC(time_t time, int saveDrift, int logMode)
+void calc_drift_model(struct drift_model *model)
 {
-	char *dt = ctime(&time);
-
-	if (verbose)
-		LOG(logMode, "Set FP RTC time to %s", dt);
+	double res[DRIFT_SAMPLES], tmp[DRIFT_SAMPLES];
+	char keep[DRIFT_SAMPLES];
+	int n = drift_count;
 
-	// Todo read FP and save the drift
+	memset(model, 0, sizeof(*model));
+	if (n == 0)
+		return;
 
-	if (saveDrift)
+	memset(keep, 1, n);
+	drift_fit(model, keep);
+	for (int pass = 0; pass < 2; pass++)
 	{
-		time_t old = getRTC();
-		int drift = (int)old - (int)time;
-		if (drift != 0)
+		for (int i = 0; i < n; i++)
 		{
-			add_drift(drift);
-			if (verbose)
-				LOG(logMode, "FP RTC time drift value:%d / data:%d %d %d %d %d %d %d %d %d %d",
-					drift, drift_data[0], drift_data[1], drift_data[2], drift_data[3],
-					drift_data[4], drift_data[5], drift_data[6], drift_data[7], drift_data[8],
-					drift_data[9]);
+			const struct drift_sample *d = &drift_data[i];
+			tmp[i] = res[i] = d->offset / d->interval - drift_model_at(model, d->temp);
 		}
+		double med = median(tmp, n);
+		for (int i = 0; i < n; i++)
+			tmp[i] = fabs(res[i] - med);
+		double limit = DRIFT_OUTLIER_MAD * median(tmp, n);
+		if (limit < DRIFT_OUTLIER_MIN)
+			limit = DRIFT_OUTLIER_MIN;
+		for (int i = 0; i < n; i++)
+			keep[i] = fabs(res[i] - med) <= limit;
+		drift_fit(model, keep);
 	}
+}
+
+/**
+ * \brief Get calculated drift value in seconds per second, positive if the RTC runs fast
+ */
+double calc_drift(void)
+{
+	struct drift_model model;
+	calc_drift_model(&model);
+	return model.drift;
+}
+
+// drift state file
+
+/**
+ * \brief On-disk drift state, followed by count struct drift_sample oldest first
+ */
+struct state_file
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t crc;	   // crc32 of header and samples with this field zero
+	uint32_t count;	   // number of samples following the header
+	double last_write; // system time of the last RTC write, offline drift counts from here
+	double saved;	   // system time of the save
+	double drift;	   // struct drift_model
+	double coef[3];
+	double tref;
+	double tmin;
+	double tmax;
+	int32_t order;
+	uint32_t flash_writes; // lifetime number of writes to flash
+};
+
+static double state_saved_drift = NAN; // drift of the model last written to flash
+static int state_saved_order = -1;
+static double state_saved_time = 0;	 // system time of the last flash write
+static double state_saved_write = 0; // last_write of the last save
+static double state_flash_write = 0; // last_write in the flash copy
+static uint32_t state_flash_writes = 0;			// lifetime flash writes, kept in the file
+static unsigned long long state_flash_bytes = 0; // bytes written to flash by this process
+static unsigned long long state_shadow_bytes = 0;
 
-	FILE *fd = fopen(proc_file, "w");
-	if (fd)
+/**
+ * \brief Bitwise crc32 (IEEE), the state file is only a few KB
+ */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	crc = ~crc;
+	while (len--)
 	{
-		if (!fprintf(fd, "%u", (unsigned int)time))
-			LOG(logMode, "Write %s failed: %m", proc_file);
-		fclose(fd);
+		crc ^= *p++;
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
 	}
-	else
+	return ~crc;
+}
+
+/**
+ * \brief Write all bytes, retrying on short writes
+ */
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	while (len)
 	{
-		int fd = open(dev_file, O_RDWR);
-		if (fd >= 0)
+		ssize_t n = write(fd, p, len);
+		if (n < 0)
 		{
-			if (ioctl(fd, FP_IOCTL_SET_RTC, (void *)&time) < 0)
-				LOG(logMode, "FP_IOCTL_SET_RTC failed: %m");
-			close(fd);
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
+		p += n;
+		len -= n;
 	}
+	return 0;
 }
 
 /**
- * \brief Read configuration from config file
+ * \brief Write a state file via temp file and rename
+ * \param    path     target file
+ * \param    durable  fsync file and directory, for the copy on flash
+ * \return   bytes written or -1
  */
-int read_conf_file(int reload)
+static ssize_t write_state_file(const char *path, const struct state_file *hdr,
+								const struct drift_sample *samples, int durable)
 {
-	FILE *conf_file = NULL;
-	int ret = -1;
-
-	if (conf_file_name == NULL)
-		return 0;
-
-	conf_file = fopen(conf_file_name, "r");
+	char tmp[256];
+	size_t len = hdr->count * sizeof(struct drift_sample);
 
-	if (conf_file == NULL)
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
 	{
-		syslog(LOG_ERR, "Can not open config file: %s, error: %s", conf_file_name, strerror(errno));
+		LOG(LOG_WARN, "Write %s failed: %m", tmp);
 		return -1;
 	}
-
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
-
-	int val = 0;
-	while ((read = getline(&line, &len, conf_file)) != -1)
+	if (write_all(fd, hdr, sizeof(*hdr)) < 0 || write_all(fd, samples, len) < 0 ||
+		(durable && fsync(fd) < 0))
 	{
-		if (line[0] == '#')
-			continue;
-		if (sscanf(line, "verbose=%d", &val) == 1)
+		LOG(LOG_WARN, "Write %s failed: %m", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0)
+	{
+		LOG(LOG_WARN, "Rename %s failed: %m", tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	if (durable)
+	{ // make the rename itself durable
+		char dir[256];
+		snprintf(dir, sizeof(dir), "%s", path);
+		char *slash = strrchr(dir, '/');
+		if (slash)
 		{
-			ret = 1;
-			verbose = val;
+			*(slash == dir ? slash + 1 : slash) = 0;
+			int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dfd >= 0)
+			{
+				fsync(dfd);
+				close(dfd);
+			}
 		}
-		if (sscanf(line, "timeout=%d", &val) == 1)
+	}
+	return sizeof(*hdr) + len;
+}
+
+/**
+ * \brief Save samples and model to the RAM shadow copy and optionally to flash
+ * \param    flush   also write the drift file on flash
+ */
+int save_state(int flush)
+{
+	struct state_file hdr;
+	struct drift_sample samples[DRIFT_SAMPLES];
+	struct drift_model m;
+
+	calc_drift_model(&m);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = STATE_MAGIC;
+	hdr.version = STATE_VERSION;
+	hdr.count = drift_count;
+	hdr.last_write = rtc_last_write ? rtc_last_write : state_saved_write;
+	hdr.saved = clock_now(CLOCK_REALTIME);
+	hdr.drift = m.drift;
+	memcpy(hdr.coef, m.coef, sizeof(hdr.coef));
+	hdr.tref = m.tref;
+	hdr.tmin = m.tmin;
+	hdr.tmax = m.tmax;
+	hdr.order = m.order;
+	hdr.flash_writes = state_flash_writes + (flush ? 1 : 0);
+
+	// ring buffer oldest first
+	int first = drift_count < DRIFT_SAMPLES ? 0 : drift_index;
+	for (int i = 0; i < drift_count; i++)
+		samples[i] = drift_data[(first + i) % DRIFT_SAMPLES];
+
+	hdr.crc = crc32_update(crc32_update(0, &hdr, sizeof(hdr)), samples,
+						   drift_count * sizeof(struct drift_sample));
+
+	ssize_t n = write_state_file(shadow_file, &hdr, samples, 0);
+	if (n > 0)
+		state_shadow_bytes += n;
+	state_saved_write = hdr.last_write;
+	if (!flush)
+		return n < 0 ? -1 : 0;
+
+	n = write_state_file(drift_file, &hdr, samples, 1);
+	if (n < 0)
+		return -1;
+	state_flash_bytes += n;
+	state_flash_writes = hdr.flash_writes;
+	state_saved_drift = m.drift;
+	state_saved_order = m.order;
+	state_saved_time = hdr.saved;
+	state_flash_write = hdr.last_write;
+	if (verbose)
+		LOG(0, "Saved drift %.3f ppm temperature order:%d samples:%d flash writes:%u bytes:%llu",
+			m.drift * 1e6, m.order, drift_count, state_flash_writes, state_flash_bytes);
+	return 0;
+}
+
+/**
+ * \brief Load one state file
+ * \param    path     file
+ * \param    hdr      header with the saved model
+ * \param    samples  sample buffer or NULL
+ * \return   0 on success, -1 if missing or invalid
+ */
+static int load_state_file(const char *path, struct state_file *hdr, struct drift_sample *samples)
+{
+	struct drift_sample tmp[DRIFT_SAMPLES];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (!samples)
+		samples = tmp;
+	ssize_t n = read(fd, hdr, sizeof(*hdr));
+	if (n != sizeof(*hdr) || hdr->magic != STATE_MAGIC || hdr->version != STATE_VERSION ||
+		hdr->count > DRIFT_SAMPLES)
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	size_t len = hdr->count * sizeof(struct drift_sample);
+	n = read(fd, samples, len);
+	close(fd);
+	uint32_t crc = hdr->crc;
+	hdr->crc = 0;
+	if (n != (ssize_t)len || crc32_update(crc32_update(0, hdr, sizeof(*hdr)), samples, len) != crc)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	hdr->crc = crc;
+	return 0;
+}
+
+/**
+ * \brief Load the newest valid state of the RAM shadow copy and the drift file
+ * \param    hdr      header with the saved model
+ * \param    restore  also restore the sample ring
+ * \return   0 on success, -1 if missing or invalid
+ */
+int load_state(struct state_file *hdr, int restore)
+{
+	struct drift_sample samples[DRIFT_SAMPLES], shadow_samples[DRIFT_SAMPLES];
+	struct state_file shadow;
+	int have_flash = load_state_file(drift_file, hdr, samples) == 0;
+	int have_shadow = load_state_file(shadow_file, &shadow, shadow_samples) == 0;
+
+	if (!have_flash && !have_shadow)
+		return -1;
+	if (have_flash)
+	{ // remember what is on flash for the save policy
+		state_saved_drift = hdr->drift;
+		state_saved_order = hdr->order;
+		state_saved_time = hdr->saved;
+		state_flash_write = hdr->last_write;
+		state_flash_writes = hdr->flash_writes;
+	}
+	if (have_shadow && (!have_flash || shadow.saved >= hdr->saved))
+	{ // the daemon was restarted without a reboot
+		*hdr = shadow;
+		memcpy(samples, shadow_samples, sizeof(shadow_samples));
+	}
+
+	if (restore)
+	{
+		memcpy(drift_data, samples, hdr->count * sizeof(struct drift_sample));
+		drift_count = hdr->count;
+		drift_index = drift_count % DRIFT_SAMPLES;
+		state_saved_write = hdr->last_write;
+	}
+	return 0;
+}
+
+/**
+ * \brief Update the RAM shadow copy, write flash only when the model changed or it got old
+ *
+ * The shadow copy keeps the last RTC write current across daemon restarts;
+ * flash is written when the drift moved by flash_drift ppm, the temperature
+ * model order changed, or the flash copy is older than flash_max_age seconds.
+ * The shadow copy is lost on a power cut, and the offline correction then counts
+ * drift from the last write on flash, so flash is also written before that stale
+ * last write would cost flash_offset seconds.
+ */
+void maybe_save_state(void)
+{
+	struct drift_model m;
+	if (drift_count == 0)
+		return;
+	calc_drift_model(&m);
+	int flush = isnan(state_saved_drift) || m.order != state_saved_order ||
+				fabs(m.drift - state_saved_drift) > flash_drift * 1e-6 ||
+				fabs(m.drift) * (rtc_last_write - state_flash_write) > flash_offset ||
+				clock_now(CLOCK_REALTIME) - state_saved_time > flash_max_age;
+	save_state(flush);
+}
+
+/**
+ * \brief Get correction in seconds for the drift since the RTC was last set, from file
+ * \param    rtctime   current RTC time
+ */
+double get_drift_seconds(int rtctime)
+{
+	struct drift_model model;
+	struct state_file hdr;
+	int lastsave = 0;
+
+	memset(&model, 0, sizeof(model));
+	if (load_state(&hdr, 0) == 0)
+	{
+		lastsave = (int)hdr.last_write;
+		model.drift = hdr.drift;
+		memcpy(model.coef, hdr.coef, sizeof(model.coef));
+		model.tref = hdr.tref;
+		model.tmin = hdr.tmin;
+		model.tmax = hdr.tmax;
+		model.order = hdr.order >= 0 && hdr.order <= 3 ? hdr.order : 0;
+	}
+	else
+	{
+		FILE *f = fopen(drift_file, "r");
+		if (!f)
+		{
+			LOG(0, "File %s not exists", drift_file);
+			return 0;
+		}
+		// text file of older versions
+		if (fscanf(f, "%d:%lf", &lastsave, &model.drift) != 2)
+		{
+			model.drift = 0;
+			lastsave = 0;
+			LOG(LOG_WARN, "Read %s failed: %m", drift_file);
+		}
+		fclose(f);
+	}
+
+	double drift = drift_model_at(&model, standby_temp);
+	if (drift != 0 && lastsave != 0)
+	{
+		// A fast RTC (drift > 0) has gained time, so the correction is negative.
+		double driftseconds = -(double)(rtctime - lastsave) * drift / (1.0 + drift);
+		if (verbose)
+		{
+			LOG(0, "FP RC drift:%.3f ppm lastsave:%d offline seconds:%d drift seconds:%.3f",
+				drift * 1e6, lastsave, rtctime - lastsave, driftseconds);
+		}
+		return driftseconds;
+	}
+	return 0;
+}
+
+// RTC backends
+
+/**
+ * \brief RTC backend operations, probed once and kept open unless exclusive
+ */
+struct rtc_backend
+{
+	const char *name;
+	const char *path; // default device path
+	int (*probe)(const struct rtc_backend *be, const char *path); // returns open fd or -1
+	int (*read)(int fd, time_t *t);
+	int (*write)(int fd, time_t t);
+	void (*close)(int fd);
+	int exclusive; // the device allows one opener, it is closed while idle
+};
+
+static const struct rtc_backend *rtc_backend = NULL;
+static const char *rtc_path = NULL;
+static char *rtc_backend_name = NULL; // forced by --backend or backend= as name[:path]
+static int rtc_fd = -1;
+static int rtc_probe_failed = 0;
+
+static int rtc_open_probe(const struct rtc_backend *be, const char *path)
+{
+	return open(path, O_RDWR | O_CLOEXEC);
+}
+
+static void rtc_close_fd(int fd) { close(fd); }
+
+// procfs: decimal epoch text
+static int rtc_text_read(int fd, time_t *t)
+{
+	char buf[32];
+	char *end;
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+	{
+		if (len == 0)
+			errno = ENODATA;
+		return -1;
+	}
+	buf[len] = 0;
+	unsigned long tmp = strtoul(buf, &end, 10);
+	if (end == buf)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	*t = (time_t)tmp;
+	return 0;
+}
+
+static int rtc_text_write(int fd, time_t t)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%u\n", (unsigned int)t);
+	return pwrite(fd, buf, len, 0) == len ? 0 : -1;
+}
+
+// fp0: vendor front processor ioctls, the drivers copy a 32 bit epoch
+static int rtc_fp0_read(int fd, time_t *t)
+{
+	uint32_t rtc = 0;
+	if (ioctl(fd, FP_IOCTL_GET_RTC, (void *)&rtc) < 0)
+		return -1;
+	*t = (time_t)rtc;
+	return 0;
+}
+
+static int rtc_fp0_write(int fd, time_t t)
+{
+	uint32_t rtc = (uint32_t)t;
+	return ioctl(fd, FP_IOCTL_SET_RTC, (void *)&rtc) < 0 ? -1 : 0;
+}
+
+// rtc: standard Linux RTC class device, kept in UTC
+static int rtc_dev_read(int fd, time_t *t)
+{
+	struct rtc_time rt;
+	struct tm tm;
+	memset(&rt, 0, sizeof(rt));
+	if (ioctl(fd, RTC_RD_TIME, &rt) < 0)
+		return -1;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_sec = rt.tm_sec;
+	tm.tm_min = rt.tm_min;
+	tm.tm_hour = rt.tm_hour;
+	tm.tm_mday = rt.tm_mday;
+	tm.tm_mon = rt.tm_mon;
+	tm.tm_year = rt.tm_year;
+	*t = timegm(&tm);
+	return *t == (time_t)-1 ? -1 : 0;
+}
+
+static int rtc_dev_write(int fd, time_t t)
+{
+	struct rtc_time rt;
+	struct tm tm;
+	if (!gmtime_r(&t, &tm))
+		return -1;
+	memset(&rt, 0, sizeof(rt));
+	rt.tm_sec = tm.tm_sec;
+	rt.tm_min = tm.tm_min;
+	rt.tm_hour = tm.tm_hour;
+	rt.tm_mday = tm.tm_mday;
+	rt.tm_mon = tm.tm_mon;
+	rt.tm_year = tm.tm_year;
+	return ioctl(fd, RTC_SET_TIME, &rt) < 0 ? -1 : 0;
+}
+
+// sim: simulated RTC in a regular file, or in memory for path "@"
+
+/**
+ * \brief Simulator fault injection, read from the environment on probe
+ */
+static struct
+{
+	double drift_ppm; // FPCLOCK_SIM_DRIFT, RTC runs fast by this rate
+	int latency_ms;	  // FPCLOCK_SIM_LATENCY, added to every access
+	int fail_pct;	  // FPCLOCK_SIM_FAIL, percentage of accesses failing with EIO
+	unsigned seed;	  // FPCLOCK_SIM_SEED, makes the failure pattern reproducible
+	int configured;	  // environment read, a reopen keeps the failure pattern going
+	int memfd;		  // RTC of path "@", kept across reopen
+} rtc_sim = {0.0, 0, 0, 1, 0, -1};
+
+static double sim_boottime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int rtc_sim_probe(const struct rtc_backend *be, const char *path)
+{
+	const char *env;
+	if (!rtc_sim.configured)
+	{
+		if ((env = getenv("FPCLOCK_SIM_DRIFT")))
+			rtc_sim.drift_ppm = atof(env);
+		if ((env = getenv("FPCLOCK_SIM_LATENCY")))
+			rtc_sim.latency_ms = atoi(env);
+		if ((env = getenv("FPCLOCK_SIM_FAIL")))
+			rtc_sim.fail_pct = atoi(env);
+		if ((env = getenv("FPCLOCK_SIM_SEED")))
+			rtc_sim.seed = (unsigned)strtoul(env, NULL, 10);
+		rtc_sim.configured = 1;
+	}
+
+	if (strcmp(path, "@") == 0)
+	{ // the memory RTC must survive the reopen after an error
+		if (rtc_sim.memfd < 0)
+			rtc_sim.memfd = memfd_create("fpclock-rtc", MFD_CLOEXEC);
+		return rtc_sim.memfd;
+	}
+	return open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static void rtc_sim_close(int fd)
+{
+	if (fd != rtc_sim.memfd)
+		close(fd);
+}
+
+/**
+ * \brief Apply configured latency and random failures to a simulator access
+ */
+static int rtc_sim_inject(void)
+{
+	if (rtc_sim.latency_ms > 0)
+	{
+		struct timespec ts = {rtc_sim.latency_ms / 1000, (rtc_sim.latency_ms % 1000) * 1000000L};
+		nanosleep(&ts, NULL);
+	}
+	if (rtc_sim.fail_pct > 0 && rand_r(&rtc_sim.seed) % 100 < rtc_sim.fail_pct)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+// The file holds "epoch boottime" of the last write; the RTC free-runs from there.
+static int rtc_sim_read(int fd, time_t *t)
+{
+	char buf[64];
+	double epoch, ref;
+	if (rtc_sim_inject() < 0)
+		return -1;
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+	{
+		if (len == 0)
+			errno = ENODATA;
+		return -1;
+	}
+	buf[len] = 0;
+	int n = sscanf(buf, "%lf %lf", &epoch, &ref);
+	if (n < 1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (n == 2)
+		epoch += (sim_boottime() - ref) * (1.0 + rtc_sim.drift_ppm / 1e6);
+	*t = (time_t)epoch;
+	return 0;
+}
+
+static int rtc_sim_write(int fd, time_t t)
+{
+	char buf[64];
+	if (rtc_sim_inject() < 0)
+		return -1;
+	int len = snprintf(buf, sizeof(buf), "%u %.6f\n", (unsigned int)t, sim_boottime());
+	if (pwrite(fd, buf, len, 0) != len)
+		return -1;
+	return ftruncate(fd, len);
+}
+
+// Auto probe tries the first RTC_AUTO_PROBE entries in order, the rest must be forced.
+static const struct rtc_backend rtc_backends[] = {
+	{"procfs", "/proc/stb/fp/rtc", rtc_open_probe, rtc_text_read, rtc_text_write, rtc_close_fd, 0},
+	{"fp0", "/dev/dbox/fp0", rtc_open_probe, rtc_fp0_read, rtc_fp0_write, rtc_close_fd, 0},
+	{"rtc", "/dev/rtc0", rtc_open_probe, rtc_dev_read, rtc_dev_write, rtc_close_fd, 1}, // EBUSY
+	{"sim", "/tmp/fpclock.rtc", rtc_sim_probe, rtc_sim_read, rtc_sim_write, rtc_sim_close, 0},
+};
+#define RTC_BACKENDS (int)(sizeof(rtc_backends) / sizeof(rtc_backends[0]))
+#define RTC_AUTO_PROBE 3 // sim is not probed automatically
+
+/**
+ * \brief Close the RTC device handle
+ */
+void rtc_close(void)
+{
+	if (rtc_fd >= 0 && rtc_backend)
+		rtc_backend->close(rtc_fd);
+	rtc_fd = -1;
+}
+
+/**
+ * \brief Close an exclusive RTC between accesses, so hwclock can open it
+ */
+void rtc_release(void)
+{
+	if (rtc_backend && rtc_backend->exclusive)
+		rtc_close();
+}
+
+/**
+ * \brief Forget the probed backend, the next access probes again
+ */
+void rtc_reset(void)
+{
+	rtc_close();
+	rtc_backend = NULL;
+	rtc_path = NULL;
+	rtc_probe_failed = 0;
+	rtc_phase_at = 0;
+	rtc_mono_base = NAN;
+}
+
+/**
+ * \brief Open one backend
+ * \param    be     backend
+ * \param    path   device path or NULL for the default
+ */
+static int rtc_try_backend(const struct rtc_backend *be, const char *path)
+{
+	if (!path || !*path)
+		path = be->path;
+	int fd = be->probe(be, path);
+	if (fd < 0)
+	{
+		if (verbose)
+			LOG(0, "%s not exists", path);
+		return -1;
+	}
+	rtc_fd = fd;
+	rtc_backend = be;
+	rtc_path = path;
+	return 0;
+}
+
+/**
+ * \brief Find a backend by its configured name
+ * \param    name   backend name, optionally followed by ":path"
+ * \param    path   set to the path after the colon or NULL
+ * \return   the backend or NULL if the name is unknown
+ */
+static const struct rtc_backend *rtc_lookup(const char *name, const char **path)
+{
+	const char *sep = strchr(name, ':');
+	size_t len = sep ? (size_t)(sep - name) : strlen(name);
+	*path = sep ? sep + 1 : NULL;
+	for (int i = 0; i < RTC_BACKENDS; i++)
+	{
+		if (strlen(rtc_backends[i].name) == len && strncmp(rtc_backends[i].name, name, len) == 0)
+			return &rtc_backends[i];
+	}
+	return NULL;
+}
+
+/**
+ * \brief Probe the RTC backend once and keep it open
+ */
+int rtc_open(void)
+{
+	if (rtc_fd >= 0)
+		return 0;
+	if (rtc_backend) // reopen after an error
+		return rtc_try_backend(rtc_backend, rtc_path);
+	if (rtc_probe_failed)
+		return -1;
+
+	if (rtc_backend_name)
+	{
+		const char *path;
+		const struct rtc_backend *be = rtc_lookup(rtc_backend_name, &path);
+		if (be && rtc_try_backend(be, path) == 0)
+			goto found;
+		if (!be)
+			LOG(0, "Unknown RTC backend %s", rtc_backend_name);
+	}
+	else
+	{
+		for (int i = 0; i < RTC_AUTO_PROBE; i++)
+		{
+			if (rtc_try_backend(&rtc_backends[i], NULL) == 0)
+				goto found;
+		}
+	}
+	rtc_probe_failed = 1;
+	return -1;
+
+found:
+	if (verbose)
+		LOG(0, "Using RTC backend %s (%s)", rtc_backend->name, rtc_path);
+	return 0;
+}
+
+/**
+ * \brief Log-linear bucket of a latency
+ */
+static int latency_bucket(uint64_t us)
+{
+	if (us < 8)
+		return (int)us;
+	int e = 63 - __builtin_clzll(us); // 3 or more
+	int i = 8 + (e - 3) * 8 + (int)((us >> (e - 3)) & 7);
+	return i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * \brief Upper bound of a log-linear bucket in microseconds
+ */
+static uint64_t latency_bucket_end(int i)
+{
+	if (i < 8)
+		return (uint64_t)i + 1;
+	int e = (i - 8) / 8 + 3;
+	return (uint64_t)(8 + (i - 8) % 8 + 1) << (e - 3);
+}
+
+/**
+ * \brief Record one RTC access latency
+ */
+static void latency_add(struct latency_hist *h, double seconds)
+{
+	uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+	h->bucket[latency_bucket(us)]++;
+	if (!h->count || us < h->min_us)
+		h->min_us = us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->count++;
+	h->sum += seconds;
+}
+
+/**
+ * \brief Latency percentile in seconds, upper bound of the bucket holding it
+ * \param    q   quantile 0..1
+ */
+double latency_percentile(const struct latency_hist *h, double q)
+{
+	if (!h->count)
+		return 0;
+	unsigned long rank = (unsigned long)ceil(q * (double)h->count);
+	unsigned long seen = 0;
+	if (rank < 1)
+		rank = 1;
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += h->bucket[i];
+		if (seen >= rank)
+		{
+			uint64_t end = latency_bucket_end(i);
+			return (double)(end < h->max_us ? end : h->max_us) / 1e6;
+		}
+	}
+	return (double)h->max_us / 1e6;
+}
+
+/**
+ * \brief Format min/p50/p99/max of a latency histogram in milliseconds
+ */
+void latency_format(char *buf, size_t len, const char *name, const struct latency_hist *h)
+{
+	snprintf(buf, len, "%s latency n:%lu min:%.3f p50:%.3f p99:%.3f max:%.3f ms", name, h->count,
+			 (double)h->min_us / 1e3, latency_percentile(h, 0.5) * 1e3,
+			 latency_percentile(h, 0.99) * 1e3, (double)h->max_us / 1e3);
+}
+
+/**
+ * \brief Log RTC latency statistics
+ * \param    print  0 = log file / 1 = console
+ */
+void log_latency_stats(int print)
+{
+	char buf[160];
+	latency_format(buf, sizeof(buf), "RTC read", &rtc_read_latency);
+	LOG(print, "%s", buf);
+	latency_format(buf, sizeof(buf), "RTC write", &rtc_write_latency);
+	LOG(print, "%s", buf);
+}
+
+/**
+ * \brief Timed backend read
+ */
+static int rtc_timed_read(time_t *t)
+{
+	double start = clock_now(CLOCK_MONOTONIC_RAW);
+	int rc = rtc_backend->read(rtc_fd, t);
+	if (rc == 0)
+	{
+		latency_add(&rtc_read_latency, clock_now(CLOCK_MONOTONIC_RAW) - start);
+		rtc_mono_base = (double)*t - clock_now(CLOCK_MONOTONIC);
+	}
+	else
+		rtc_read_errors++;
+	return rc;
+}
+
+/**
+ * \brief Timed backend write
+ */
+static int rtc_timed_write(time_t t)
+{
+	double start = clock_now(CLOCK_MONOTONIC_RAW);
+	int rc = rtc_backend->write(rtc_fd, t);
+	if (rc == 0)
+	{
+		latency_add(&rtc_write_latency, clock_now(CLOCK_MONOTONIC_RAW) - start);
+		rtc_mono_base = (double)t - clock_now(CLOCK_MONOTONIC);
+	}
+	else
+		rtc_write_errors++;
+	return rc;
+}
+
+/**
+ * \brief Read epoch from RTC, reopen the device once on error
+ * \param    t   result
+ */
+int rtc_read(time_t *t)
+{
+	if (rtc_open() < 0)
+		return -1;
+	if (rtc_timed_read(t) == 0)
+		return 0;
+	rtc_close();
+	if (rtc_open() < 0)
+		return -1;
+	return rtc_timed_read(t);
+}
+
+/**
+ * \brief Write epoch to RTC, reopen the device once on error
+ * \param    t   new epoch
+ */
+int rtc_write(time_t t)
+{
+	if (rtc_open() < 0)
+		return -1;
+	if (rtc_timed_write(t) == 0)
+		return 0;
+	rtc_close();
+	if (rtc_open() < 0)
+		return -1;
+	return rtc_timed_write(t);
+}
+
+/**
+ * \brief Get epoch from RTC
+ */
+time_t getRTC(void)
+{
+	time_t rtc_time = 0;
+	if (rtc_read(&rtc_time) < 0)
+	{
+		if (rtc_backend)
+			LOG(LOG_WARN, "Read %s failed: %m", rtc_path);
+		return 0;
+	}
+#ifdef HAVE_NO_RTC
+	rtc_time = 0; // Sorry no RTC
+#endif
+	rtc_last_read = rtc_time;
+	rtc_last_read_at = clock_now(CLOCK_REALTIME);
+	return rtc_time;
+}
+
+/**
+ * \brief Sleep until shortly before the predicted RTC rollover
+ *
+ * The phase from the last edge measurement or write predicts the rollover, the
+ * margin grows with its age. Without a usable phase this returns at once and the
+ * caller polls up to a whole second.
+ */
+void rtc_wait_edge(void)
+{
+	if (!rtc_phase_at)
+		return;
+	double now = clock_now(CLOCK_REALTIME);
+	double age = now - rtc_phase_at;
+	double margin = RTC_EDGE_MARGIN + fabs(age) * RTC_EDGE_UNCERTAINTY +
+					latency_percentile(&rtc_read_latency, 0.99); // the first read must start early
+	if (age < 0 || margin >= 0.5)
+		return;
+	double offset = rtc_phase_offset + calc_drift() * age;
+	double wake = ceil(now + margin + offset) - offset - margin;
+	struct timespec ts = {(time_t)wake, (long)((wake - floor(wake)) * 1e9)};
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/**
+ * \brief Poll the RTC until its second rolls over
+ * \param    rtc         RTC epoch right after the rollover
+ * \param    clk         clock used to timestamp the rollover
+ * \param    edge        time of the rollover on clk
+ * \param    timeout_ms  maximum time to wait for the rollover
+ * \return   0 on success, 1 on timeout, -1 on read error
+ */
+int rtc_read_edge(time_t *rtc, clockid_t clk, double *edge, int timeout_ms)
+{
+	long poll_ns = RTC_EDGE_POLL_NS;
+	time_t first, cur;
+	double prev, now, before, deadline;
+
+#ifdef HAVE_NO_RTC
+	return -1; // Sorry no RTC
+#endif
+	if (rtc_read_latency.count >= LATENCY_MIN_SAMPLES)
+	{ // polling faster than a read takes only adds device traffic
+		long lat = (long)(latency_percentile(&rtc_read_latency, 0.5) * 1e9);
+		if (lat > poll_ns)
+			poll_ns = lat < RTC_EDGE_POLL_MAX_NS ? lat : RTC_EDGE_POLL_MAX_NS;
+	}
+	struct timespec poll = {0, poll_ns};
+	if (clk == CLOCK_REALTIME)
+		rtc_wait_edge();
+
+	// A read samples the RTC somewhere during the call, take the middle of it.
+	before = clock_now(clk);
+	if (rtc_read(&first) < 0)
+		return -1;
+	prev = (before + clock_now(clk)) / 2.0;
+	deadline = prev + (double)timeout_ms / 1000.0;
+	for (;;)
+	{
+		nanosleep(&poll, NULL);
+		before = clock_now(clk);
+		if (rtc_read(&cur) < 0)
+			return -1;
+		now = (before + clock_now(clk)) / 2.0;
+		if (cur != first)
+		{ // the rollover happened between the two reads
+			*rtc = cur;
+			*edge = (prev + now) / 2.0;
+			if (clk == CLOCK_REALTIME)
+			{
+				rtc_phase_offset = (double)cur - *edge;
+				rtc_phase_at = *edge;
+			}
+			return 0;
+		}
+		if (now > deadline)
+		{
+			*rtc = cur;
+			*edge = now;
+			return 1;
+		}
+		prev = now;
+	}
+}
+
+/**
+ * \brief Set epoch to RTC
+ * \param    time   New epoch time value.
+ */
+int setRTC(time_t time, int logMode)
+{
+	char *dt = ctime(&time);
+
+	if (verbose)
+		LOG(logMode, "Set FP RTC time to %s", dt);
+
+	if (rtc_write(time) < 0)
+	{
+		if (rtc_backend)
+			LOG(logMode | LOG_WARN, "Write %s failed: %m", rtc_path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Time to start an RTC write ahead of the second it should land in
+ */
+double write_lead(void)
+{
+	double lead = 0;
+	if (rtc_apply_samples)
+		lead = rtc_apply_delay;
+	else if (rtc_write_latency.count >= LATENCY_MIN_SAMPLES)
+		lead = latency_percentile(&rtc_write_latency, 0.5) / 2.0; // until measured
+	return lead > APPLY_MAX ? APPLY_MAX : lead;
+}
+
+/**
+ * \brief Measure where the RTC second landed after a write and update the apply delay
+ * \param    lead   time the write was started ahead of the second
+ *
+ * The residual phase is what the lead missed. It is kept as the base of the next drift
+ * sample, so it does not show up as drift.
+ */
+void measure_apply_delay(double lead, int logMode)
+{
+	time_t rtc;
+	double at;
+	if (rtc_read_edge(&rtc, CLOCK_REALTIME, &at, RTC_EDGE_TIMEOUT_MS) != 0)
+		return;
+	double residual = (double)rtc - at; // negative if the RTC landed late
+	if (fabs(residual) >= APPLY_MAX)
+	{
+		if (verbose)
+			LOG(logMode, "FP RTC write residual %.3f seconds ignored", residual);
+		return;
+	}
+	rtc_write_offset = residual;
+	double delay = lead - residual;
+	if (delay < 0)
+		delay = 0;
+	if (rtc_apply_samples++ == 0)
+		rtc_apply_delay = delay;
+	else
+		rtc_apply_delay += APPLY_GAIN * (delay - rtc_apply_delay);
+	if (verbose)
+		LOG(logMode, "FP RTC write residual:%.4f apply delay:%.4f seconds", residual, rtc_apply_delay);
+}
+
+/**
+ * \brief Set RTC to the system time at the next whole second
+ * \param    saveDrift  measure the RTC offset first and record it as drift sample
+ */
+void updateRTC(int saveDrift, int logMode)
+{
+	struct timespec now, next;
+
+	if (saveDrift)
+	{
+		time_t rtc;
+		double at;
+		int rc = rtc_read_edge(&rtc, CLOCK_REALTIME, &at, RTC_EDGE_TIMEOUT_MS);
+		if (rc == 0)
+		{
+			double offset = (double)rtc - at;
+			rtc_last_read = rtc;
+			rtc_last_read_at = at;
+			rtc_last_offset = offset;
+			if (rtc_last_write)
+				add_drift(offset - rtc_write_offset, at - rtc_last_write);
+			if (verbose)
+				LOG(logMode, "FP RTC time offset:%.3f after %.0f seconds / drift:%.3f ppm from %d samples",
+					offset, rtc_last_write ? at - rtc_last_write : 0.0, calc_drift() * 1e6,
+					drift_count);
+			// Keep writing until a write time is known, the drift samples count from it.
+			if (write_threshold > 0 && rtc_last_write && fabs(offset) <= write_threshold)
+			{
+				rtc_writes_skipped++;
+				if (verbose)
+					LOG(logMode, "FP RTC within %.3f seconds, write skipped (issued:%lu skipped:%lu)",
+						write_threshold, rtc_writes_issued, rtc_writes_skipped);
+				return;
+			}
+		}
+		else if (rc > 0)
+			LOG(logMode, "FP RTC second did not roll over, no drift sample");
+	}
+
+	// The RTC counts whole seconds, so the write should land on the system second edge.
+	// Start it early by the apply delay, the written value is the second it lands in.
+	double lead = write_lead();
+	clock_gettime(CLOCK_REALTIME, &now);
+	next.tv_sec = now.tv_sec + 1;
+	next.tv_nsec = 0;
+	struct timespec start = next;
+	if (lead > 0)
+	{
+		start.tv_sec = next.tv_sec - 1;
+		start.tv_nsec = 1000000000L - (long)(lead * 1e9);
+		if (start.tv_sec < now.tv_sec || (start.tv_sec == now.tv_sec && start.tv_nsec <= now.tv_nsec))
+		{ // too late for this second
+			next.tv_sec++;
+			start.tv_sec++;
+		}
+	}
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &start, NULL) == EINTR)
+		;
+	rtc_writes_issued++;
+	if (setRTC(next.tv_sec, logMode) < 0)
+		return;
+	rtc_last_write = (double)next.tv_sec;
+	rtc_write_offset = 0;
+	rtc_phase_offset = 0; // the lead aims the write at the second edge
+	rtc_phase_at = rtc_last_write;
+	if (saveDrift)
+		measure_apply_delay(lead, logMode);
+}
+
+/**
+ * \brief Read configuration from config file
+ */
+int read_conf_file(int reload)
+{
+	FILE *conf_file = NULL;
+	int ret = -1;
+
+	if (conf_file_name == NULL)
+		return 0;
+
+	conf_file = fopen(conf_file_name, "r");
+
+	if (conf_file == NULL)
+	{
+		syslog(LOG_ERR, "Can not open config file: %s, error: %s", conf_file_name, strerror(errno));
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+
+	int val = 0;
+	double dval = 0;
+	char str[256];
+	while ((read = getline(&line, &len, conf_file)) != -1)
+	{
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "backend=%255s", str) == 1)
+		{
+			ret = 1;
+			if (!rtc_backend_name || strcmp(rtc_backend_name, str) != 0)
+			{
+				free(rtc_backend_name);
+				rtc_backend_name = strdup(str);
+				rtc_reset();
+			}
+		}
+		if (sscanf(line, "verbose=%d", &val) == 1)
+		{
+			ret = 1;
+			verbose = val;
+		}
+		if (sscanf(line, "ram_log=%d", &val) == 1 && val >= 0)
+		{
+			ret = 1;
+			ram_log_kb = val; // used at start only
+		}
+		if (sscanf(line, "precise=%d", &val) == 1)
+		{
+			ret = 1;
+			precise = val;
+		}
+		if (sscanf(line, "slew_rate=%lf", &dval) == 1 && dval > 0)
+		{
+			ret = 1;
+			slew_rate = dval > SLEW_KERNEL_RATE ? SLEW_KERNEL_RATE : dval;
+		}
+		if (sscanf(line, "slew_time=%lf", &dval) == 1 && dval >= 0)
+		{
+			ret = 1;
+			slew_time_max = dval;
+		}
+		if (sscanf(line, "standby_temp=%lf", &dval) == 1)
+		{
+			ret = 1;
+			standby_temp = dval;
+		}
+		if (sscanf(line, "flash_drift=%lf", &dval) == 1 && dval >= 0)
+		{
+			ret = 1;
+			flash_drift = dval;
+		}
+		if (sscanf(line, "flash_offset=%lf", &dval) == 1 && dval > 0)
+		{
+			ret = 1;
+			flash_offset = dval;
+		}
+		if (sscanf(line, "flash_max_age=%d", &val) == 1)
+		{
+			ret = 1;
+			flash_max_age = val;
+		}
+		if (sscanf(line, "step_window=%d", &val) == 1)
+		{
+			ret = 1;
+			step_window = val;
+		}
+		if (sscanf(line, "max_error=%lf", &dval) == 1)
+		{
+			ret = 1;
+			max_error = dval;
+		}
+		if (sscanf(line, "min_interval=%d", &val) == 1 && val > 0)
+		{
+			ret = 1;
+			min_interval = val;
+		}
+		if (sscanf(line, "max_interval=%d", &val) == 1 && val > 0)
+		{
+			ret = 1;
+			max_interval = val;
+		}
+		if (sscanf(line, "write_threshold=%lf", &dval) == 1)
+		{
+			ret = 1;
+			write_threshold = dval;
+		}
+		if (sscanf(line, "metrics_file=%255s", str) == 1)
+		{
+			ret = 1;
+			free(metrics_file);
+			metrics_file = strdup(str);
+		}
+		if (sscanf(line, "timeout=%d", &val) == 1)
+		{
+			ret = 1;
+			delay = val;
+		}
+	}
+
+	if (line)
+		free(line);
+
+	if (ret > 0)
+	{
+		if (reload == 1)
+		{
+			syslog(LOG_INFO, "Reloaded configuration file %s of %s", conf_file_name, app_name);
+		}
+		else
+		{
+			syslog(LOG_INFO, "Configuration of %s read from file %s", app_name, conf_file_name);
+		}
+	}
+
+	fclose(conf_file);
+
+	return ret;
+}
+
+/**
+ * \brief About to suspend or power off, leave the RTC and drift file fresh
+ */
+void prepare_suspend(void)
+{
+	updateRTC(1, 0);
+	save_state(1);
+	arm_update_timer();
+}
+
+/**
+ * \brief Handle a signal delivered through the event loop.
+ * \param    sig    identifier of signal
+ */
+void handle_signal(int sig)
+{
+	if (sig == SIGINT || sig == SIGTERM)
+	{
+		LOG(0, "Debug: stopping daemon ...");
+
+		if (pid_fd != -1)
+		{ // Unlock and close lockfile.
+			lockf(pid_fd, F_ULOCK, 0);
+			close(pid_fd);
+		}
+		if (pid_file_name != NULL)
+		{ // Try to delete lockfile.
+			unlink(pid_file_name);
+		}
+		// leave the RTC fresh for the power down, then save drift info
+		updateRTC(1, 0);
+		LOG(0, "Write drift %.9f", calc_drift());
+		save_state(1);
+		LOG(0, "Drift state bytes written flash:%llu shadow:%llu", state_flash_bytes,
+			state_shadow_bytes);
+		LOG(0, "FP RTC writes issued:%lu skipped:%lu", rtc_writes_issued, rtc_writes_skipped);
+		running = 0;
+	}
+	else if (sig == SIGUSR1)
+	{
+		log_latency_stats(0);
+	}
+	else if (sig == SIGUSR2)
+	{
+		LOG(0, "Debug: preparing for suspend ...");
+		prepare_suspend();
+	}
+	else if (sig == SIGHUP)
+	{
+		LOG(0, "Debug: reloading daemon config file ...");
+		read_conf_file(1);
+		arm_update_timer(); // timeout may have changed
+	}
+	else if (sig == SIGCHLD)
+	{
+		LOG(0, "Debug: received SIGCHLD signal");
+	}
+}
+
+/**
+ * \brief clean variables
+ */
+void clean(void)
+{
+	// Free allocated memory
+	if (conf_file_name != NULL)
+		free(conf_file_name);
+	if (log_file_name != NULL)
+		free(log_file_name);
+	if (pid_file_name != NULL)
+		free(pid_file_name);
+	if (rtc_backend_name != NULL)
+		free(rtc_backend_name);
+	if (metrics_file != NULL)
+		free(metrics_file);
+}
+
+/**
+ * \brief clean exit
+ */
+static void clean_exit(int code)
+{
+	clean();
+	exit(code);
+}
+
+/**
+ * \brief Write and lock the PID file
+ */
+static void write_pid_file(void)
+{
+	if (pid_file_name != NULL)
+	{ // Try to write PID of daemon to lockfile.
+		char str[256];
+		pid_fd = open(pid_file_name, O_RDWR | O_CREAT, 0640);
+		if (pid_fd < 0)
+		{
+			LOG(1, "Can't open lockfile.!");
+			clean_exit(EXIT_FAILURE); // Can't open lockfile.
+		}
+		if (lockf(pid_fd, F_TLOCK, 0) < 0)
+		{
+			LOG(1, "Can't lock lockfile.!");
+			clean_exit(EXIT_FAILURE); // Can't lock file.
+		}
+		snprintf(str, 256, "%d\n", getpid());		   // Get current PID.
+		ssize_t ret = write(pid_fd, str, strlen(str)); // Write PID to lockfile.
+	}
+}
+
+/**
+ * \brief Close all descriptors from first on
+ *
+ * Costs one syscall per open descriptor at most, instead of one per possible
+ * descriptor up to RLIMIT_NOFILE.
+ */
+static void close_inherited_fds(int first)
+{
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, (unsigned int)first, ~0U, 0) == 0)
+		return;
+#endif
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir)
+	{
+		struct dirent *de;
+		while ((de = readdir(dir)) != NULL)
+		{
+			int fd = atoi(de->d_name);
+			if (fd >= first && fd != dirfd(dir))
+				close(fd);
+		}
+		closedir(dir);
+		return;
+	}
+	for (int fd = (int)sysconf(_SC_OPEN_MAX); fd >= first; fd--)
+		close(fd); // no /proc
+}
+
+/**
+ * \brief This function will daemonize this app
+ */
+static void daemonize()
+{
+	pid_t pid = 0;
+
+	fflush(NULL); // the parents exit through stdio, do not hand them a copy of pending output
+	pid = fork(); // Fork off the parent process.
+
+	if (pid < 0)
+	{ // An error occurred.
+		LOG(1, "fork failed!");
+		clean_exit(EXIT_FAILURE);
+	}
+
+	if (pid > 0)
+	{ // Success: Let the parent terminate.
+		clean_exit(EXIT_SUCCESS);
+	}
+
+	if (setsid() < 0)
+	{ // On success the child process becomes session leader.
+		LOG(1, "setsid failed!");
+		clean_exit(EXIT_FAILURE);
+	}
+
+	signal(SIGCHLD, SIG_IGN); // Ignore signal sent from child to parent process.
+
+	pid = fork(); // Fork off for the second time.
+
+	if (pid < 0)
+	{ // An error occurred.
+		LOG(1, "fork failed!");
+		clean_exit(EXIT_FAILURE);
+	}
+
+	if (pid > 0)
+	{ // Daemon started successfully let the parent terminate.
+		clean_exit(EXIT_SUCCESS);
+	}
+
+	umask(0); // Set new file permissions.
+
+	int chdir_ret = chdir("/"); // Change the working directory to the root directory or another
+								// appropriated directory.
+
+	close_inherited_fds(3); // Close all open inherited file descriptors.
+
+	/* Point stdin (fd = 0), stdout (fd = 1), stderr (fd = 2) to /dev/null */
+	int null_fd = open("/dev/null", O_RDWR);
+	if (null_fd >= 0)
+	{
+		dup2(null_fd, STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		if (null_fd > STDERR_FILENO)
+			close(null_fd);
+	}
+
+	write_pid_file();
+}
+
+/**
+ * \brief Register an event source with the event loop
+ * \param    src    source with a valid fd and handler
+ */
+int add_event_source(struct event_source *src)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) < 0)
+	{
+		LOG(LOG_WARN, "epoll_ctl add fd %d failed: %m", src->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Seconds until the next RTC update
+ *
+ * With max_error set, the interval is the time the RTC needs at the fitted
+ * drift to accumulate that error, bounded by min_interval and max_interval.
+ * Otherwise, or while there are too few samples, the fixed timeout is used.
+ */
+int next_update_interval(void)
+{
+	if (delay < 1)
+		delay = 1;
+	if (max_error <= 0 || drift_count < ADAPTIVE_MIN_SAMPLES)
+		return delay;
+
+	double drift = fabs(calc_drift());
+	double interval = drift > 0 ? max_error / drift : (double)max_interval;
+	if (interval > max_interval)
+		interval = max_interval;
+	if (interval < min_interval)
+		interval = min_interval;
+	return interval < 1 ? 1 : (int)interval;
+}
+
+/**
+ * \brief Open the service manager notification socket named by NOTIFY_SOCKET
+ *
+ * This is the sd_notify datagram protocol, so no libsystemd is needed.
+ */
+int notify_open(void)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (!path || !*path)
+		return 0;
+	size_t len = strlen(path);
+	if ((path[0] != '/' && path[0] != '@') || len >= sizeof(notify_addr.sun_path))
+	{
+		LOG(LOG_WARN, "Invalid NOTIFY_SOCKET %s", path);
+		return -1;
+	}
+	memset(&notify_addr, 0, sizeof(notify_addr));
+	notify_addr.sun_family = AF_UNIX;
+	memcpy(notify_addr.sun_path, path, len);
+	if (path[0] == '@')
+		notify_addr.sun_path[0] = 0; // abstract namespace
+	notify_addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+	notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (notify_fd < 0)
+	{
+		LOG(LOG_WARN, "Notify socket failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Send a state change like READY=1 to the service manager
+ */
+void notify(const char *format, ...)
+{
+	char buf[256];
+	va_list args;
+	if (notify_fd < 0)
+		return;
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	if (sendto(notify_fd, buf, strlen(buf), MSG_NOSIGNAL, (struct sockaddr *)&notify_addr,
+			   notify_addr_len) < 0 &&
+		verbose)
+		LOG(0, "Notify %s failed: %m", buf);
+}
+
+/**
+ * \brief Close the notification socket
+ */
+void notify_close(void)
+{
+	if (notify_fd >= 0)
+		close(notify_fd);
+	notify_fd = -1;
+}
+
+/**
+ * \brief Watchdog timer expired, tell the service manager the loop is alive
+ */
+static void on_watchdog(struct event_source *src, uint32_t events)
+{
+	uint64_t expirations;
+	if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	notify("WATCHDOG=1");
+}
+
+/**
+ * \brief Ping the service manager watchdog from the event loop at half WATCHDOG_USEC
+ */
+int setup_watchdog(void)
+{
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	struct itimerspec its;
+
+	if (notify_fd < 0 || !usec || (pid && (pid_t)atol(pid) != getpid()))
+		return 0;
+	unsigned long long half = strtoull(usec, NULL, 10) / 2;
+	if (half == 0)
+		return 0;
+	watchdog_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (watchdog_timer.fd < 0)
+	{
+		LOG(LOG_WARN, "timerfd_create watchdog failed: %m");
+		return -1;
+	}
+	watchdog_timer.handler = on_watchdog;
+	its.it_value.tv_sec = (time_t)(half / 1000000);
+	its.it_value.tv_nsec = (long)(half % 1000000) * 1000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(watchdog_timer.fd, 0, &its, NULL) < 0)
+	{
+		LOG(LOG_WARN, "timerfd_settime watchdog failed: %m");
+		return -1;
+	}
+	if (verbose)
+		LOG(0, "Watchdog ping every %llu ms", half / 1000);
+	return add_event_source(&watchdog_timer);
+}
+
+/**
+ * \brief Create the shared memory status page
+ */
+int status_open(void)
+{
+	int fd = open(FPCLOCK_STATUS_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		LOG(LOG_WARN, "Open %s failed: %m", FPCLOCK_STATUS_PATH);
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(struct fpclock_status)) < 0)
+	{
+		LOG(LOG_WARN, "Resize %s failed: %m", FPCLOCK_STATUS_PATH);
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, sizeof(struct fpclock_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		LOG(LOG_WARN, "Map %s failed: %m", FPCLOCK_STATUS_PATH);
+		return -1;
+	}
+	status_page = p;
+	return 0;
+}
+
+/**
+ * \brief Remove the status page
+ */
+void status_close(void)
+{
+	if (!status_page)
+		return;
+	munmap(status_page, sizeof(struct fpclock_status));
+	status_page = NULL;
+	unlink(FPCLOCK_STATUS_PATH);
+}
+
+/**
+ * \brief Print one latency histogram in Prometheus text format
+ */
+static void metrics_histogram(FILE *f, const char *name, const char *help,
+							  const struct latency_hist *h)
+{
+	unsigned long cumulative = 0;
+	int b = 0;
+	fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (int i = 0; i < PROM_BUCKETS; i++)
+	{
+		while (b < LATENCY_BUCKETS && latency_bucket_end(b) <= (uint64_t)(latency_bounds[i] * 1e6))
+			cumulative += h->bucket[b++];
+		fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", name, latency_bounds[i], cumulative);
+	}
+	fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+	fprintf(f, "%s_sum %.9f\n%s_count %lu\n", name, h->sum, name, h->count);
+}
+
+/**
+ * \brief Write the metrics file for the node exporter textfile collector
+ */
+void metrics_write(void)
+{
+	char tmp[256];
+	if (!metrics_file)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_file);
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+	{
+		LOG(LOG_WARN, "Write %s failed: %m", tmp);
+		return;
+	}
+	metrics_histogram(f, "fpclock_rtc_read_seconds", "RTC read latency.", &rtc_read_latency);
+	metrics_histogram(f, "fpclock_rtc_write_seconds", "RTC write latency.", &rtc_write_latency);
+	fprintf(f, "# HELP fpclock_rtc_read_errors_total Failed RTC reads.\n");
+	fprintf(f, "# TYPE fpclock_rtc_read_errors_total counter\n");
+	fprintf(f, "fpclock_rtc_read_errors_total %lu\n", rtc_read_errors);
+	fprintf(f, "# HELP fpclock_rtc_write_errors_total Failed RTC writes.\n");
+	fprintf(f, "# TYPE fpclock_rtc_write_errors_total counter\n");
+	fprintf(f, "fpclock_rtc_write_errors_total %lu\n", rtc_write_errors);
+	fprintf(f, "# HELP fpclock_rtc_writes_total RTC updates by result.\n");
+	fprintf(f, "# TYPE fpclock_rtc_writes_total counter\n");
+	fprintf(f, "fpclock_rtc_writes_total{result=\"issued\"} %lu\n", rtc_writes_issued);
+	fprintf(f, "fpclock_rtc_writes_total{result=\"skipped\"} %lu\n", rtc_writes_skipped);
+	fprintf(f, "# HELP fpclock_rtc_offset_seconds RTC minus system time at the last measurement.\n");
+	fprintf(f, "# TYPE fpclock_rtc_offset_seconds gauge\n");
+	fprintf(f, "fpclock_rtc_offset_seconds %.6f\n", rtc_last_offset);
+	fprintf(f, "# HELP fpclock_rtc_apply_delay_seconds Estimated time for a write to reach the RTC.\n");
+	fprintf(f, "# TYPE fpclock_rtc_apply_delay_seconds gauge\n");
+	fprintf(f, "fpclock_rtc_apply_delay_seconds %.6f\n", rtc_apply_delay);
+	fprintf(f, "# HELP fpclock_drift_ppm Fitted RTC drift, positive if the RTC runs fast.\n");
+	fprintf(f, "# TYPE fpclock_drift_ppm gauge\n");
+	fprintf(f, "fpclock_drift_ppm %.6f\n", calc_drift() * 1e6);
+	fprintf(f, "# HELP fpclock_drift_samples Drift samples in the model.\n");
+	fprintf(f, "# TYPE fpclock_drift_samples gauge\n");
+	fprintf(f, "fpclock_drift_samples %d\n", drift_count);
+	// the file is only rewritten per update, so export the time and let the age be computed
+	fprintf(f, "# HELP fpclock_last_sync_timestamp_seconds Time of the last RTC write.\n");
+	fprintf(f, "# TYPE fpclock_last_sync_timestamp_seconds gauge\n");
+	fprintf(f, "fpclock_last_sync_timestamp_seconds %.3f\n", rtc_last_write);
+	fprintf(f, "# HELP fpclock_loop_wakeups_total Event loop wakeups.\n");
+	fprintf(f, "# TYPE fpclock_loop_wakeups_total counter\n");
+	fprintf(f, "fpclock_loop_wakeups_total %lu\n", loop_wakeups);
+	fprintf(f, "# HELP fpclock_log_dropped_total Log lines dropped because the log queue was full.\n");
+	fprintf(f, "# TYPE fpclock_log_dropped_total counter\n");
+	fprintf(f, "fpclock_log_dropped_total %lu\n", log_dropped);
+	fprintf(f, "# HELP fpclock_flash_bytes_total Drift state bytes written to flash.\n");
+	fprintf(f, "# TYPE fpclock_flash_bytes_total counter\n");
+	fprintf(f, "fpclock_flash_bytes_total %llu\n", state_flash_bytes);
+	if (fclose(f) != 0 || rename(tmp, metrics_file) < 0)
+	{
+		LOG(LOG_WARN, "Write %s failed: %m", metrics_file);
+		unlink(tmp);
+	}
+}
+
+/**
+ * \brief Publish the current state to the status page and metrics file
+ */
+void status_publish(void)
+{
+	struct fpclock_status *st = status_page;
+	struct itimerspec its;
+	metrics_write();
+	memset(&its, 0, sizeof(its));
+	if (update_timer.fd >= 0)
+		timerfd_gettime(update_timer.fd, &its);
+	double drift = calc_drift();
+	notify("STATUS=RTC offset %.3f s, drift %.3f ppm from %d samples, next update in %ld s",
+		   rtc_last_offset, drift * 1e6, drift_count, (long)its.it_value.tv_sec);
+	if (!st)
+		return;
+
+	uint32_t seq = st->seq;
+	__atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	st->magic = FPCLOCK_STATUS_MAGIC;
+	st->version = FPCLOCK_STATUS_VERSION;
+	st->pid = getpid();
+	st->rtc_time = rtc_last_read;
+	st->rtc_read_at = rtc_last_read_at;
+	st->offset = rtc_last_offset;
+	st->drift_ppm = drift * 1e6;
+	st->last_write = rtc_last_write;
+	st->next_update = clock_now(CLOCK_REALTIME) + (double)its.it_value.tv_sec +
+					  (double)its.it_value.tv_nsec / 1e9;
+	st->writes_issued = rtc_writes_issued;
+	st->writes_skipped = rtc_writes_skipped;
+	st->samples = drift_count;
+	snprintf(st->backend, sizeof(st->backend), "%s", rtc_backend ? rtc_backend->name : "none");
+	__atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief (Re)arm the RTC update timer for the next update
+ */
+void arm_update_timer(void)
+{
+	struct itimerspec its;
+	if (update_timer.fd < 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next_update_interval();
+	if (timerfd_settime(update_timer.fd, 0, &its, NULL) < 0)
+		LOG(LOG_WARN, "timerfd_settime failed: %m");
+	else if (verbose)
+		LOG(0, "Next FP RTC update in %ld seconds", (long)its.it_value.tv_sec);
+	status_publish(); // every update path re-arms the timer
+}
+
+/**
+ * \brief Detect a system suspend since the last call and resync from the RTC
+ *
+ * CLOCK_BOOTTIME includes suspend time and CLOCK_MONOTONIC does not, so their
+ * difference grows by the time spent suspended.
+ * \return   1 if the system was resumed
+ */
+int check_resume(void)
+{
+	double suspended = clock_now(CLOCK_BOOTTIME) - clock_now(CLOCK_MONOTONIC);
+	double slept = isnan(suspend_base) ? 0 : suspended - suspend_base;
+	suspend_base = suspended;
+	if (slept < RESUME_MIN_SLEEP)
+		return 0;
+
+	LOG(0, "Resumed after %.0f seconds of suspend", slept);
+	if (sync_fp(0) > 0)
+		rtc_last_write = 0; // the RTC offset now reflects our correction, not drift
+	status_publish();
+	return 1;
+}
+
+/**
+ * \brief Detect a suspend from the RTC and resync from it
+ *
+ * Kernels without a persistent clock do not add the suspend time to
+ * CLOCK_BOOTTIME, but the RTC kept counting while CLOCK_MONOTONIC stood still.
+ * \return   1 if the system was resumed
+ */
+int check_resume_rtc(void)
+{
+	double base = rtc_mono_base;
+	time_t t;
+	if (isnan(base) || rtc_read(&t) < 0)
+		return 0;
+	double slept = (double)t - clock_now(CLOCK_MONOTONIC) - base;
+	if (slept < RESUME_MIN_SLEEP)
+		return 0;
+
+	LOG(0, "Resumed after %.0f seconds of suspend seen by the RTC", slept);
+	suspend_base = clock_now(CLOCK_BOOTTIME) - clock_now(CLOCK_MONOTONIC);
+	if (sync_fp(0) > 0)
+		rtc_last_write = 0; // the RTC offset now reflects our correction, not drift
+	status_publish();
+	return 1;
+}
+
+/**
+ * \brief Arm the realtime timer that is cancelled by any clock step
+ */
+int arm_clock_step_timer(void)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	// Absolute expiry far in the future, it only ever fires by cancellation.
+	its.it_value.tv_sec = (time_t)INT32_MAX;
+	if (timerfd_settime(clock_step_timer.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its,
+						NULL) < 0)
+	{
+		LOG(LOG_WARN, "timerfd_settime CANCEL_ON_SET failed: %m");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * \brief System clock was stepped, push the new time to the RTC immediately
+ *
+ * Every resume also cancels the timer. If the system time is behind by the
+ * suspend, the RTC is right and the system time is restored from it instead.
+ */
+static void on_clock_step(struct event_source *src, uint32_t events)
+{
+	uint64_t expirations;
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0 && errno != ECANCELED)
+		return;
+	arm_clock_step_timer();
+	if (check_resume_rtc())
+	{
+		arm_update_timer();
+		return;
+	}
+
+	LOG(0, "System clock changed, updating FP RTC");
+	// The RTC offset after a step is not drift, so don't record a sample.
+	updateRTC(0, 0);
+	arm_update_timer();
+}
+
+/**
+ * \brief Update timer expired, write system time to RTC
+ */
+static void on_update_timer(struct event_source *src, uint32_t events)
+{
+	uint64_t expirations;
+	if (read(src->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	write_fp(-1);
+	maybe_save_state();
+	arm_update_timer();
+}
+
+/**
+ * \brief Drain pending signals from the signalfd
+ */
+static void on_signal(struct event_source *src, uint32_t events)
+{
+	struct signalfd_siginfo si;
+	while (read(src->fd, &si, sizeof(si)) == sizeof(si))
+		handle_signal((int)si.ssi_signo);
+}
+
+/**
+ * \brief Create epoll instance, update timer and signalfd
+ */
+int setup_event_loop(void)
+{
+	sigset_t mask;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+	{
+		LOG(LOG_WARN, "epoll_create1 failed: %m");
+		return -1;
+	}
+
+	// Block the signals so they are only delivered through the signalfd.
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+	{
+		LOG(LOG_WARN, "sigprocmask failed: %m");
+		return -1;
+	}
+
+	signal_source.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_source.fd < 0)
+	{
+		LOG(LOG_WARN, "signalfd failed: %m");
+		return -1;
+	}
+	signal_source.handler = on_signal;
+	if (add_event_source(&signal_source) < 0)
+		return -1;
+
+	// CLOCK_BOOTTIME keeps counting in suspend, an update due meanwhile runs right on resume.
+	update_timer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (update_timer.fd < 0)
+	{
+		LOG(LOG_WARN, "timerfd_create failed: %m");
+		return -1;
+	}
+	update_timer.handler = on_update_timer;
+	if (add_event_source(&update_timer) < 0)
+		return -1;
+	arm_update_timer();
+
+	clock_step_timer.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (clock_step_timer.fd < 0)
+	{
+		LOG(LOG_WARN, "timerfd_create CLOCK_REALTIME failed: %m");
+		return -1;
+	}
+	clock_step_timer.handler = on_clock_step;
+	if (arm_clock_step_timer() < 0 || add_event_source(&clock_step_timer) < 0)
+		return -1;
+
+	if (setup_watchdog() < 0)
+		return -1;
+
+	check_resume();
+	return 0;
+}
+
+/**
+ * \brief Close event loop descriptors
+ */
+void close_event_loop(void)
+{
+	if (update_timer.fd >= 0)
+		close(update_timer.fd);
+	if (clock_step_timer.fd >= 0)
+		close(clock_step_timer.fd);
+	if (signal_source.fd >= 0)
+		close(signal_source.fd);
+	if (watchdog_timer.fd >= 0)
+		close(watchdog_timer.fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	update_timer.fd = clock_step_timer.fd = signal_source.fd = watchdog_timer.fd = epoll_fd = -1;
+}
+
+/**
+ * \brief Dispatch events until the daemon is stopped
+ */
+void run_event_loop(void)
+{
+	struct epoll_event events[8];
+	while (running == 1)
+	{
+		int n = epoll_wait(epoll_fd, events, 8, -1);
+		if (n < 0)
 		{
-			ret = 1;
-			delay = val;
+			if (errno == EINTR)
+				continue;
+			LOG(LOG_WARN, "epoll_wait failed: %m");
+			break;
+		}
+		loop_wakeups++;
+		check_resume();
+		for (int i = 0; i < n; i++)
+		{
+			struct event_source *src = events[i].data.ptr;
+			src->handler(src, events[i].events);
 		}
+		rtc_release();
+		log_flush(); // after the handlers, off their timing path
 	}
+}
 
-	if (line)
-		free(line);
+/**
+ * \brief Print command line options help.
+ */
+void print_help(void)
+{
+	printf("%s: Version %s\n\n", APP, app_ver);
+	printf("Usage: %s [OPTIONS]\n\n", app_name);
+	printf("  Options:\n");
+	printf("\t-h --help                 Print this help text.\n");
+	printf("\t-c --conf_file filename   Read configuration from the file.\n");
+	printf("\t-t --timeout timeout      Set the loop timeout in seconds. (Default 1800)\n");
+	printf("\t-l --log_file  filename   Write logs to the file. (Only for daemon mode)\n");
+	printf("\t-d --daemon               Daemonize this application.\n");
+	printf("\t-F --foreground           Run the daemon in the foreground, for a service manager.\n");
+	printf("\t-p --print                Print FP clock time.\n");
+	printf("\t-u --update               Update FP clock with the current system time.\n");
+	printf("\t-f --force epoch          Force FP clock to given epoch time.\n");
+	printf("\t-r --restore              Restore current system time from FP  clock.\n");
+	printf("\t-S --stats                Print RTC access latency statistics.\n");
+	printf("\t-D --dump_log             Print the in-memory daemon log.\n");
+	printf("\t-s --suspend              Let the daemon write the RTC and drift state, wait for it.\n");
+	printf("\t-P --precise              Restore with sub-second precision from the RTC edge.\n");
+	printf("\t-R --fast_restore         Restore without daemon, drift or config, for early boot.\n");
+	printf("\t   --bench_restore runs   Time fpclock -R runs against the simulated RTC.\n");
+	printf("\t-b --backend name[:path] Force RTC backend procfs, fp0, rtc or sim.\n");
+	printf("\t                          (Default from FPCLOCK_BACKEND, sim path @ = memory)\n");
+	printf("\t-v --verbose              Enable debugging output.\n");
+	printf("\n");
+}
 
-	if (ret > 0)
+/**
+ * \brief Prints time from RTC
+ */
+int print_fp(void)
+{
+	time_t time = getRTC();
+	if (time)
 	{
-		if (reload == 1)
+		char *dt = ctime(&time);
+		LOG(1, "Read result:%s", dt);
+	}
+	else
+	{
+		LOG(1, "Read RTC failed");
+	}
+	return 0;
+}
+
+/**
+ * \brief Set epoch to RTC
+ * \param    c   New epoch
+ */
+int write_fp(int c)
+{
+	if (c != -1)
+	{
+		if (verbose)
+			LOG(1, "Write %d", c);
+
+		if (c < 1672527600)
+		{ // 1.1.2023
+			LOG(1, "Write Error epoch:%d to low.", c);
+			return 1;
+		}
+		setRTC(c, 1);
+	}
+	else
+	{
+		updateRTC(1, 0);
+	}
+	return 0;
+}
+
+// time correction
+
+/**
+ * \brief Step system time by an offset
+ * \param    offset   seconds to add to system time
+ */
+int step_time(double offset, int logMode)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	double target = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9 + offset;
+	ts.tv_sec = (time_t)target;
+	ts.tv_nsec = (long)((target - (double)ts.tv_sec) * 1e9);
+	if (ts.tv_nsec < 0)
+	{
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000L;
+	}
+	if (clock_settime(CLOCK_REALTIME, &ts) < 0)
+	{
+		LOG(logMode | LOG_WARN, "Stepping Linux time by %.3f seconds FAILED! (%d) %m", offset, errno);
+		return -1;
+	}
+	rtc_phase_at = 0; // the RTC phase was relative to the old time
+	LOG(logMode | LOG_WARN, "Stepped Linux time by %.3f seconds.", offset);
+	return 0;
+}
+
+/**
+ * \brief Slew system time by an offset, the kernel applies it at 500 ppm
+ * \param    offset   seconds to add to system time
+ */
+int slew_time(double offset, int logMode)
+{
+	struct timex tx;
+	if (fabs(offset) > SLEW_MAX_OFFSET)
+	{
+		LOG(logMode, "Slewing Linux time by %.3f seconds not possible, limit is %d.", offset,
+			SLEW_MAX_OFFSET);
+		return -1;
+	}
+	memset(&tx, 0, sizeof(tx));
+	tx.modes = ADJ_OFFSET_SINGLESHOT;
+	tx.offset = (long)(offset * 1e6);
+	if (clock_adjtime(CLOCK_REALTIME, &tx) < 0)
+	{
+		LOG(logMode | LOG_WARN, "Slewing Linux time by %.3f seconds FAILED! (%d) %m", offset, errno);
+		return -1;
+	}
+	rtc_phase_at = 0;
+	LOG(logMode, "Slewing Linux time by %.3f seconds, takes %.0f seconds.", offset,
+		fabs(offset) / (SLEW_KERNEL_RATE * 1e-6));
+	return 0;
+}
+
+/**
+ * \brief Correct system time, choosing between slew and step
+ * \param    offset   seconds to add to system time
+ *
+ * Offsets that can be slewed at slew_rate within slew_time seconds are slewed,
+ * larger ones are stepped. Outside the step window only slewing is used.
+ */
+int correct_time(double offset, int logMode)
+{
+	double slew_limit = slew_rate * 1e-6 * slew_time_max;
+	int may_step = step_window <= 0 || clock_now(CLOCK_BOOTTIME) < (double)step_window;
+
+	if (fabs(offset) <= slew_limit || !may_step)
+	{
+		if (slew_time(offset, logMode) == 0)
+			return 0;
+		if (!may_step)
 		{
-			syslog(LOG_INFO, "Reloaded configuration file %s of %s", conf_file_name, app_name);
+			LOG(logMode | LOG_WARN, "Not stepping Linux time, step window of %d seconds is over.",
+				step_window);
+			return -1;
+		}
+	}
+	return step_time(offset, logMode);
+}
+
+/**
+ * \brief Correct system time from the RTC second edge with sub-second precision
+ * \return   1 if corrected, 0 if not needed, -1 if no edge was seen and whole seconds must be used
+ */
+int sync_fp_precise(int cmdline)
+{
+	time_t rtc_time;
+	double edge;
+
+	int rc = rtc_read_edge(&rtc_time, CLOCK_MONOTONIC, &edge, RTC_EDGE_TIMEOUT_MS);
+	if (rc != 0 || rtc_time == 0)
+	{
+		if (rc > 0)
+			LOG(cmdline, "FP RTC second did not roll over, using whole seconds");
+		return -1;
+	}
+
+	// RTC was exactly at rtc_time at the edge, advance by the monotonic time since.
+	double base = (double)rtc_time;
+	if (!cmdline)
+		base += get_drift_seconds(rtc_time);
+
+	double time_difference = base + (clock_now(CLOCK_MONOTONIC) - edge) - clock_now(CLOCK_REALTIME);
+	if (fabs(time_difference) <= PRECISE_MIN_OFFSET)
+	{
+		if (verbose)
+			LOG(cmdline, "Linux time within %.3f seconds of FP RTC.", time_difference);
+		return 0;
+	}
+
+	return correct_time(time_difference, cmdline) == 0 ? 1 : 0;
+}
+
+/**
+ * \brief write epoch from RTC to system
+ * \return   1 if the system time was corrected
+ */
+int sync_fp(int cmdline)
+{
+	int rc = precise ? sync_fp_precise(cmdline) : -1;
+	if (rc >= 0)
+		return rc;
+
+	time_t rtc_time = getRTC();
+	time_t system_time = time(0);
+
+	if (rtc_time)
+	{
+		if (!cmdline)
+		{
+			rtc_time += (time_t)lround(get_drift_seconds(rtc_time));
+		}
+
+		int time_difference = (int)rtc_time - (int)system_time;
+		int atime_difference = abs(time_difference);
+		if (atime_difference > 30)
+		{ // diff higher than 30 seconds
+			return correct_time((double)time_difference, cmdline) == 0 ? 1 : 0;
 		}
+	}
+	else
+	{
+		LOG(cmdline | LOG_WARN, "Sync failed Update because FP RTC time is 0");
+	}
+
+	return 0;
+}
+
+// control socket
+
+/**
+ * \brief Reply of a control command
+ */
+struct ctl_reply
+{
+	char buf[2048];
+	size_t len;
+};
+
+/**
+ * \brief Append a line to a control reply
+ */
+static void ctl_printf(struct ctl_reply *r, const char *format, ...)
+{
+	va_list args;
+	if (r->len >= sizeof(r->buf))
+		return;
+	va_start(args, format);
+	int n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, format, args);
+	va_end(args);
+	if (n > 0)
+		r->len += (size_t)n < sizeof(r->buf) - r->len ? (size_t)n : sizeof(r->buf) - r->len - 1;
+}
+
+/**
+ * \brief Execute a control command
+ * \param    cmd   command line without newline
+ * \param    r     reply, "OK" or "ERR reason" followed by key=value lines
+ */
+void ctl_command(char *cmd, struct ctl_reply *r)
+{
+	char *arg = strchr(cmd, ' ');
+	if (arg)
+		*arg++ = 0;
+
+	if (strcmp(cmd, "get-status") == 0 || strcmp(cmd, "status") == 0)
+	{
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		if (update_timer.fd >= 0)
+			timerfd_gettime(update_timer.fd, &its);
+		ctl_printf(r, "OK\n");
+		ctl_printf(r, "version=%s\n", app_ver);
+		ctl_printf(r, "backend=%s\n", rtc_backend ? rtc_backend->name : "none");
+		ctl_printf(r, "rtc_path=%s\n", rtc_path ? rtc_path : "");
+		ctl_printf(r, "last_write=%.3f\n", rtc_last_write);
+		ctl_printf(r, "next_update=%ld\n", (long)its.it_value.tv_sec);
+		ctl_printf(r, "drift_ppm=%.3f\n", calc_drift() * 1e6);
+		ctl_printf(r, "samples=%d\n", drift_count);
+		ctl_printf(r, "writes_issued=%lu\n", rtc_writes_issued);
+		ctl_printf(r, "writes_skipped=%lu\n", rtc_writes_skipped);
+		ctl_printf(r, "apply_delay=%.4f\n", rtc_apply_delay);
+		ctl_printf(r, "log_dropped=%lu\n", log_dropped);
+		ctl_printf(r, "flash_bytes=%llu\n", state_flash_bytes);
+		ctl_printf(r, "flash_writes=%u\n", state_flash_writes);
+	}
+	else if (strcmp(cmd, "read-rtc") == 0)
+	{
+		time_t t = getRTC();
+		if (t)
+			ctl_printf(r, "OK\nrtc=%ld\nsystem=%.3f\n", (long)t, clock_now(CLOCK_REALTIME));
+		else
+			ctl_printf(r, "ERR read RTC failed\n");
+	}
+	else if (strcmp(cmd, "update-now") == 0)
+	{
+		updateRTC(1, 0);
+		maybe_save_state();
+		arm_update_timer();
+		ctl_printf(r, "OK\nlast_write=%.3f\n", rtc_last_write);
+	}
+	else if (strcmp(cmd, "set-rtc") == 0)
+	{
+		long epoch = arg ? atol(arg) : 0;
+		if (epoch < 1672527600) // 1.1.2023
+			ctl_printf(r, "ERR epoch %ld to low\n", epoch);
+		else if (setRTC((time_t)epoch, 0) < 0)
+			ctl_printf(r, "ERR write RTC failed\n");
 		else
 		{
-			syslog(LOG_INFO, "Configuration of %s read from file %s", app_name, conf_file_name);
+			rtc_last_write = 0; // RTC no longer follows the system time
+			status_publish();
+			ctl_printf(r, "OK\n");
 		}
 	}
-
-	fclose(conf_file);
-
-	return ret;
+	else if (strcmp(cmd, "restore-now") == 0)
+	{
+		// "raw" restores the plain RTC time like a standalone -r, without drift correction
+		int raw = arg && strcmp(arg, "raw") == 0;
+		int corrected = sync_fp(raw) > 0;
+		if (corrected)
+			rtc_last_write = 0; // the RTC offset now reflects our correction, not drift
+		status_publish();
+		ctl_printf(r, "OK\ncorrected=%d\n", corrected);
+	}
+	else if (strcmp(cmd, "get-drift") == 0)
+	{
+		struct drift_model m;
+		calc_drift_model(&m);
+		ctl_printf(r, "OK\ndrift_ppm=%.3f\nsamples=%d\norder=%d\n", m.drift * 1e6, drift_count,
+				   m.order);
+		if (m.order)
+			ctl_printf(r, "coef_ppm=%.6g,%.6g,%.6g\ntref=%.2f\ntmin=%.2f\ntmax=%.2f\n",
+					   m.coef[0] * 1e6, m.coef[1] * 1e6, m.coef[2] * 1e6, m.tref, m.tmin, m.tmax);
+	}
+	else if (strcmp(cmd, "stats") == 0)
+	{
+		char buf[160];
+		latency_format(buf, sizeof(buf), "RTC read", &rtc_read_latency);
+		ctl_printf(r, "OK\nread=%s\n", buf);
+		latency_format(buf, sizeof(buf), "RTC write", &rtc_write_latency);
+		ctl_printf(r, "write=%s\nread_errors=%lu\nwrite_errors=%lu\n", buf, rtc_read_errors,
+				   rtc_write_errors);
+	}
+	else if (strcmp(cmd, "reload") == 0)
+	{
+		read_conf_file(1);
+		arm_update_timer();
+		ctl_printf(r, "OK\n");
+	}
+	else if (strcmp(cmd, "suspend") == 0)
+	{
+		prepare_suspend();
+		ctl_printf(r, "OK\n");
+	}
+	else
+		ctl_printf(r, "ERR unknown command %s\n", cmd);
 }
 
 /**
- * \brief Callback function for handling signals.
- * \param    sig    identifier of signal
+ * \brief Send all bytes to a socket, a peer that went away is an error, not SIGPIPE
  */
-void handle_signal(int sig)
+static int send_all(int fd, const void *data, size_t len)
 {
-	if (sig == SIGINT)
+	const char *p = data;
+	while (len)
 	{
-		LOG(0, "Debug: stopping daemon ...");
-
-		if (pid_fd != -1)
-		{ // Unlock and close lockfile.
-			lockf(pid_fd, F_ULOCK, 0);
-			close(pid_fd);
-		}
-		if (pid_file_name != NULL)
-		{ // Try to delete lockfile.
-			unlink(pid_file_name);
-		}
-		// save drift info
-		FILE *fd = fopen(drift_file, "w");
-		if (fd)
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0)
 		{
-			double drift = calc_drift();
-			LOG(0, "Write drift %ld:%lf", time(0), drift);
-			if (!fprintf(fd, "%ld:%lf", time(0), drift))
-				LOG(0, "Write %s failed: %m", drift_file);
-			fclose(fd);
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
-		running = 0;
-		signal(SIGINT, SIG_DFL); // Reset signal handling to default behavior.
+		p += n;
+		len -= n;
 	}
-	else if (sig == SIGHUP)
+	return 0;
+}
+
+/**
+ * \brief Serve one control connection: read a command line, reply, close
+ */
+static void on_control(struct event_source *src, uint32_t events)
+{
+	struct timeval tv = {0, CTL_TIMEOUT_MS * 1000};
+	struct ctl_reply reply;
+	char line[256];
+	size_t len = 0;
+
+	int fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	// a stalled client must not block the event loop for long
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	while (len < sizeof(line) - 1)
 	{
-		LOG(0, "Debug: reloading daemon config file ...");
-		read_conf_file(1);
+		ssize_t n = read(fd, line + len, sizeof(line) - 1 - len);
+		if (n <= 0)
+			break;
+		len += n;
+		if (memchr(line, '\n', len))
+			break;
 	}
-	else if (sig == SIGCHLD)
+	line[len] = 0;
+	line[strcspn(line, "\r\n")] = 0;
+
+	reply.len = 0;
+	if (len)
 	{
-		LOG(0, "Debug: received SIGCHLD signal");
+		ctl_command(line, &reply);
+		send_all(fd, reply.buf, reply.len); // the client may have closed already
 	}
+	close(fd);
 }
 
 /**
- * \brief clean variables
+ * \brief Listen on the control socket
  */
-void clean(void)
+int setup_control_socket(void)
 {
-	// Free allocated memory
-	if (conf_file_name != NULL)
-		free(conf_file_name);
-	if (log_file_name != NULL)
-		free(log_file_name);
-	if (pid_file_name != NULL)
-		free(pid_file_name);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ctl_socket);
+
+	ctl_listener.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ctl_listener.fd < 0)
+	{
+		LOG(LOG_WARN, "Control socket failed: %m");
+		return -1;
+	}
+	unlink(ctl_socket); // stale socket, the pid file lock guarantees a single daemon
+	if (bind(ctl_listener.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		chmod(ctl_socket, 0660) < 0 || listen(ctl_listener.fd, 4) < 0)
+	{
+		LOG(LOG_WARN, "Control socket %s failed: %m", ctl_socket);
+		close(ctl_listener.fd);
+		ctl_listener.fd = -1;
+		return -1;
+	}
+	ctl_listener.handler = on_control;
+	return add_event_source(&ctl_listener);
 }
 
 /**
- * \brief clean exit
+ * \brief Close and remove the control socket
  */
-static void clean_exit(int code)
+void close_control_socket(void)
 {
-	clean();
-	exit(code);
+	if (ctl_listener.fd < 0)
+		return;
+	close(ctl_listener.fd);
+	ctl_listener.fd = -1;
+	unlink(ctl_socket);
 }
 
 /**
- * \brief This function will daemonize this app
+ * \brief Send a command to a running daemon
+ * \param    cmd     command line
+ * \param    reply   reply text
+ * \return   0 if the daemon replied, -1 if no daemon is running
  */
-static void daemonize()
+int ctl_request(const char *cmd, struct ctl_reply *reply)
 {
-	pid_t pid = 0;
-	int fd;
-
-	pid = fork(); // Fork off the parent process.
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ctl_socket);
 
-	if (pid < 0)
-	{ // An error occurred.
-		LOG(1, "fork failed!");
-		clean_exit(EXIT_FAILURE);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
 	}
-
-	if (pid > 0)
-	{ // Success: Let the parent terminate.
-		clean_exit(EXIT_SUCCESS);
+	reply->len = 0;
+	if (send_all(fd, cmd, strlen(cmd)) < 0 || send_all(fd, "\n", 1) < 0)
+	{
+		close(fd);
+		return -1;
 	}
-
-	if (setsid() < 0)
-	{ // On success the child process becomes session leader.
-		LOG(1, "setsid failed!");
-		clean_exit(EXIT_FAILURE);
+	while (reply->len < sizeof(reply->buf) - 1)
+	{
+		ssize_t n = read(fd, reply->buf + reply->len, sizeof(reply->buf) - 1 - reply->len);
+		if (n <= 0)
+			break;
+		reply->len += n;
 	}
+	reply->buf[reply->len] = 0;
+	close(fd);
+	return reply->len ? 0 : -1;
+}
 
-	signal(SIGCHLD, SIG_IGN); // Ignore signal sent from child to parent process.
-
-	pid = fork(); // Fork off for the second time.
+/**
+ * \brief Run a command line action through a running daemon
+ * \param    action   1 print, 2 update or force, 3 restore, 4 stats, 6 suspend
+ * \return   0 if handled by the daemon, -1 to access the hardware directly
+ */
+int ctl_client(int action)
+{
+	struct ctl_reply reply;
+	char cmd[64];
+
+	if (action == 1)
+		snprintf(cmd, sizeof(cmd), "read-rtc");
+	else if (action == 2 && forcedate != -1)
+		snprintf(cmd, sizeof(cmd), "set-rtc %d", forcedate);
+	else if (action == 2)
+		snprintf(cmd, sizeof(cmd), "update-now");
+	else if (action == 3)
+		snprintf(cmd, sizeof(cmd), "restore-now raw");
+	else if (action == 4)
+		snprintf(cmd, sizeof(cmd), "stats");
+	else if (action == 6)
+		snprintf(cmd, sizeof(cmd), "suspend");
+	else
+		return -1;
 
-	if (pid < 0)
-	{ // An error occurred.
-		LOG(1, "fork failed!");
-		clean_exit(EXIT_FAILURE);
+	if (ctl_request(cmd, &reply) < 0)
+		return -1;
+	if (verbose)
+		LOG(1, "Daemon reply to %s:\n%s", cmd, reply.buf);
+	if (strncmp(reply.buf, "OK", 2) != 0)
+	{
+		reply.buf[strcspn(reply.buf, "\n")] = 0;
+		LOG(1, "Daemon: %s", reply.buf);
+		return 0;
 	}
-
-	if (pid > 0)
-	{ // Daemon started successfully let the parent terminate.
-		clean_exit(EXIT_SUCCESS);
+	if (action == 1)
+	{
+		char *p = strstr(reply.buf, "rtc=");
+		time_t t = p ? (time_t)atol(p + 4) : 0;
+		LOG(1, "Read result:%s", ctime(&t));
 	}
-
-	umask(0); // Set new file permissions.
-
-	int chdir_ret = chdir("/"); // Change the working directory to the root directory or another
-								// appropriated directory.
-
-	for (fd = (int)sysconf(_SC_OPEN_MAX); fd > 0;
-		 fd--)
-	{ // Close all open inherited file descriptors.
-		close(fd);
+	else if (action == 4)
+	{
+		char *line = strtok(reply.buf + 2, "\n");
+		for (; line; line = strtok(NULL, "\n"))
+			LOG(1, "%s", line);
 	}
+	return 0;
+}
 
-	/* Reopen stdin (fd = 0), stdout (fd = 1), stderr (fd = 2) */
-	stdin = fopen("/dev/null", "r");
-	stdout = fopen("/dev/null", "w+");
-	stderr = fopen("/dev/null", "w+");
-
-	if (pid_file_name != NULL)
-	{ // Try to write PID of daemon to lockfile.
-		char str[256];
-		pid_fd = open(pid_file_name, O_RDWR | O_CREAT, 0640);
-		if (pid_fd < 0)
-		{
-			LOG(1, "Can't open lockfile.!");
-			clean_exit(EXIT_FAILURE); // Can't open lockfile.
-		}
-		if (lockf(pid_fd, F_TLOCK, 0) < 0)
-		{
-			LOG(1, "Can't lock lockfile.!");
-			clean_exit(EXIT_FAILURE); // Can't lock file.
-		}
-		snprintf(str, 256, "%d\n", getpid());		   // Get current PID.
-		ssize_t ret = write(pid_fd, str, strlen(str)); // Write PID to lockfile.
+/**
+ * \brief Sample RTC reads and print latency statistics without a daemon
+ */
+void print_stats(void)
+{
+	time_t t;
+	for (int i = 0; i < STATS_SAMPLES; i++)
+	{
+		if (rtc_read(&t) < 0)
+			break;
 	}
+	log_latency_stats(1);
 }
 
 /**
- * \brief Print command line options help.
+ * \brief Write a message to stderr without stdio
  */
-void print_help(void)
+static void fast_error(const char *msg)
 {
-	printf("%s: Version %s\n\n", APP, app_ver);
-	printf("Usage: %s [OPTIONS]\n\n", app_name);
-	printf("  Options:\n");
-	printf("\t-h --help                 Print this help text.\n");
-	printf("\t-c --conf_file filename   Read configuration from the file.\n");
-	printf("\t-t --timeout timeout      Set the loop timeout in seconds. (Default 1800)\n");
-	printf("\t-l --log_file  filename   Write logs to the file. (Only for daemon mode)\n");
-	printf("\t-d --daemon               Daemonize this application.\n");
-	printf("\t-p --print                Print FP clock time.\n");
-	printf("\t-u --update               Update FP clock with the current system time.\n");
-	printf("\t-f --force epoch          Force FP clock to given epoch time.\n");
-	printf("\t-r --restore              Restore current system time from FP  clock.\n");
-	printf("\t-v --verbose              Enable debugging output.\n");
-	printf("\n");
+	if (write(STDERR_FILENO, msg, strlen(msg)) < 0)
+		return;
 }
 
 /**
- * \brief Prints time from RTC
+ * \brief Restore the system time from the RTC on the boot path
+ *
+ * Unlike -r this skips the daemon, the drift state, stdio and the heap: probe the
+ * backend once, read it and step the clock. It runs from a static build too.
  */
-int print_fp(void)
+int fast_restore(void)
 {
-	time_t time = getRTC();
-	if (time)
+	struct timespec now;
+	time_t rtc;
+
+#ifdef HAVE_NO_RTC
+	fast_error("fpclock: built without RTC support\n");
+	return EXIT_FAILURE;
+#endif
+	if (!rtc_backend_name)
+		rtc_backend_name = getenv("FPCLOCK_BACKEND"); // not freed, the caller exits
+	const char *path;
+	if (rtc_backend_name && !rtc_lookup(rtc_backend_name, &path))
 	{
-		char *dt = ctime(&time);
-		LOG(1, "Read result:%s", dt);
+		fast_error("fpclock: unknown RTC backend\n");
+		return EXIT_FAILURE;
 	}
-	else
+	if (rtc_open() < 0)
 	{
-		LOG(1, "Read RTC failed");
+		fast_error("fpclock: no RTC found\n");
+		return EXIT_FAILURE;
 	}
-	return 0;
-}
-
-/**
- * \brief Set epoch to RTC
- * \param    c   New epoch
- */
-int write_fp(int c)
-{
-	if (c != -1)
+	if (rtc_backend->read(rtc_fd, &rtc) < 0 || rtc == 0)
 	{
-		if (verbose)
-			LOG(1, "Write %d", c);
-
-		if (c < 1672527600)
-		{ // 1.1.2023
-			LOG(1, "Write Error epoch:%d to low.", c);
-			return 1;
-		}
-		setRTC(c, 0, 1);
+		fast_error("fpclock: RTC read failed\n");
+		return EXIT_FAILURE;
 	}
-	else
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (llabs((long long)rtc - (long long)now.tv_sec) > FAST_RESTORE_MIN)
 	{
-		setRTC(time(0), 1, 0);
+		struct timespec ts = {rtc, 0};
+		if (clock_settime(CLOCK_REALTIME, &ts) < 0)
+		{
+			fast_error("fpclock: setting the time failed\n");
+			return EXIT_FAILURE;
+		}
 	}
-	return 0;
+	return EXIT_SUCCESS;
 }
 
 /**
- * \brief write epoch from RTC to system
+ * \brief Measure exec to exit of fpclock -R against the simulated RTC
+ * \param    runs   number of runs
+ *
+ * The simulated RTC is set to the system time first, so the runs read and compare
+ * but do not step the clock. FPCLOCK_BENCH_RTC overrides the simulator file.
  */
-int sync_fp(int cmdline)
+int bench_restore(int runs)
 {
-	time_t rtc_time = getRTC();
-	time_t system_time = time(0);
+	const char *path = getenv("FPCLOCK_BENCH_RTC") ? getenv("FPCLOCK_BENCH_RTC")
+												   : "/tmp/fpclock-bench.rtc";
+	char backend[300], env[320];
+	struct latency_hist hist;
+	int failed = 0;
+
+	snprintf(backend, sizeof(backend), "sim:%s", path);
+	free(rtc_backend_name);
+	rtc_backend_name = strdup(backend);
+	rtc_reset();
+	if (rtc_write(time(NULL)) < 0)
+	{
+		LOG(1, "Write %s failed: %m", path);
+		return -1;
+	}
+	rtc_close();
 
-	if (rtc_time)
+	snprintf(env, sizeof(env), "FPCLOCK_BACKEND=%s", backend);
+	char *child_argv[] = {"fpclock", "-R", NULL};
+	char *child_env[] = {env, NULL};
+	memset(&hist, 0, sizeof(hist));
+	for (int i = 0; i < runs; i++)
 	{
-		if (!cmdline)
+		pid_t pid;
+		int status;
+		double start = clock_now(CLOCK_MONOTONIC_RAW);
+		if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, child_argv, child_env) != 0 ||
+			waitpid(pid, &status, 0) < 0)
 		{
-			int drift = get_drift_seconds(rtc_time);
-			rtc_time += drift;
-		}
-
-		int time_difference = (int)rtc_time - (int)system_time;
-		int atime_difference = abs(time_difference);
-		if (atime_difference > 30)
-		{ // diff higher than 30 seconds
-			struct timeval tdelta, tolddelta;
-			tdelta.tv_sec = time_difference;
-			int rc = adjtime(&tdelta, &tolddelta);
-			if (rc == -1)
-			{
-				if (errno == EINVAL)
-				{
-					struct timeval tnow;
-					gettimeofday(&tnow, 0);
-					tnow.tv_sec = time_difference;
-					settimeofday(&tnow, 0);
-					LOG(cmdline, "Slewing Linux time by %d seconds.", time_difference);
-				}
-				else
-				{
-					LOG(cmdline, "Slewing Linux time by %d seconds FAILED! (%d) %m",
-						time_difference, errno);
-				}
-			}
-			else
-				LOG(cmdline, "Slewing Linux time by %d seconds.", time_difference);
+			LOG(1, "Start of fpclock -R failed: %m");
+			return -1;
 		}
-	}
-	else
-	{
-		LOG(cmdline, "Sync failed Update because FP RTC time is 0");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			failed++;
+		latency_add(&hist, clock_now(CLOCK_MONOTONIC_RAW) - start);
 	}
 
-	return 0;
+	char buf[160];
+	latency_format(buf, sizeof(buf), "fpclock -R", &hist);
+	LOG(1, "%s, %d failed", buf, failed);
+	return failed ? -1 : 0;
 }
 
 /**
@@ -584,19 +3387,31 @@ int main(int argc, char *argv[])
 {
 	static struct option long_options[] = {{"timeout", required_argument, 0, 't'},
 										   {"force", required_argument, 0, 'f'},
-										   //        {"conf_file", required_argument, 0, 'c'},
+										   {"conf_file", required_argument, 0, 'c'},
 										   {"test_conf", required_argument, 0, 't'},
 										   {"log_file", required_argument, 0, 'l'},
 										   {"help", no_argument, 0, 'h'},
 										   {"daemon", no_argument, 0, 'd'},
+										   {"foreground", no_argument, 0, 'F'},
 										   {"verbose", no_argument, 0, 'v'},
 										   {"restore", no_argument, 0, 'r'},
+										   {"precise", no_argument, 0, 'P'},
 										   {"print", no_argument, 0, 'p'},
 										   {"update", no_argument, 0, 'u'},
+										   {"backend", required_argument, 0, 'b'},
+										   {"stats", no_argument, 0, 'S'},
+										   {"dump_log", no_argument, 0, 'D'},
+										   {"fast_restore", no_argument, 0, 'R'},
+										   {"bench_restore", required_argument, 0, 'B'},
+										   {"suspend", no_argument, 0, 's'},
 										   {NULL, 0, 0, 0}};
 	int value, option_index = 0;
 	int start_daemonized = 0;
 
+	// Boot path, before anything else is set up.
+	if (argc == 2 && (strcmp(argv[1], "-R") == 0 || strcmp(argv[1], "--fast_restore") == 0))
+		return fast_restore();
+
 	if (argc == 1)
 	{
 		print_help();
@@ -611,7 +3426,7 @@ int main(int argc, char *argv[])
 
 	int action = 0;
 
-	while ((value = getopt_long(argc, argv, "l:t:f:pdhrudpv", long_options, &option_index)) != -1)
+	while ((value = getopt_long(argc, argv, "c:l:t:f:b:pdhrudpvPSDFRs", long_options, &option_index)) != -1)
 	{
 		switch (value)
 		{
@@ -624,9 +3439,16 @@ int main(int argc, char *argv[])
 		case 'l':
 			log_file_name = strdup(optarg);
 			break;
+		case 'b':
+			free(rtc_backend_name);
+			rtc_backend_name = strdup(optarg);
+			break;
 		case 'd':
 			start_daemonized = 1;
 			break;
+		case 'F':
+			start_daemonized = 2;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -637,6 +3459,9 @@ int main(int argc, char *argv[])
 		case 'r':
 			action = 3;
 			break;
+		case 'P':
+			precise = 1;
+			break;
 		case 'u':
 			action = 2;
 			break;
@@ -647,6 +3472,23 @@ int main(int argc, char *argv[])
 		case 'p':
 			action = 1;
 			break;
+		case 'S':
+			action = 4;
+			break;
+		case 'D':
+			ram_log_dump();
+			clean();
+			return EXIT_SUCCESS;
+		case 'R':
+			action = 5;
+			break;
+		case 's':
+			action = 6;
+			break;
+		case 'B':
+			value = bench_restore(atoi(optarg));
+			clean();
+			return value < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 		case '?':
 			print_help();
 			clean();
@@ -656,6 +3498,9 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (rtc_backend_name == NULL && getenv("FPCLOCK_BACKEND"))
+		rtc_backend_name = strdup(getenv("FPCLOCK_BACKEND"));
+
 	if (verbose)
 	{
 		LOG(1, "Version %s\n\n", app_ver);
@@ -665,28 +3510,49 @@ int main(int argc, char *argv[])
 			LOG(1, "Force epoch : %d", forcedate);
 	}
 
+	if (action && ctl_client(action) == 0)
+	{ // a running daemon owns the RTC
+		clean();
+		return EXIT_SUCCESS;
+	}
+
 	if (action)
 	{
 		if (action == 1)
 		{
 			print_fp();
 		}
-		else if (action == 2)
-		{
+		else if (action == 2 || action == 6)
+		{ // without a daemon a suspend only needs the RTC written
 			write_fp(forcedate);
 		}
 		else if (action == 3)
 		{
 			sync_fp(1);
 		}
+		else if (action == 4)
+		{
+			print_stats();
+		}
+		else if (action == 5)
+		{
+			value = fast_restore();
+			clean();
+			return value;
+		}
 		clean();
 		return EXIT_SUCCESS;
 	}
 
-	if (start_daemonized)
+	if (start_daemonized == 1)
 	{ // When daemonizing is requested at command line.
 		daemonize();
 	}
+	else if (start_daemonized == 2)
+	{ // Supervised, the service manager keeps track of the process.
+		write_pid_file();
+		notify_open();
+	}
 	else
 	{
 		clean();
@@ -697,10 +3563,6 @@ int main(int argc, char *argv[])
 	openlog(argv[0], LOG_PID | LOG_CONS, LOG_DAEMON);
 	syslog(LOG_INFO, "Started %s V:%s", app_name, app_ver);
 
-	/* Daemon will handle two signals */
-	signal(SIGINT, handle_signal);
-	signal(SIGHUP, handle_signal);
-
 	/* Try to open log file to this daemon */
 	if (log_file_name != NULL)
 	{
@@ -714,34 +3576,62 @@ int main(int argc, char *argv[])
 
 	// Read configuration from config file.
 	read_conf_file(0);
+	ram_log_open();
 
 	// This global variable can be changed in function handling signal.
 	running = 1;
 
-	for (int x = 0; x < 10; x++)
-		drift_data[x] = -1;
-
 	LOG(0, "Start loop");
 
+	struct state_file state;
+	if (load_state(&state, 1) == 0)
+		LOG(0, "Loaded %d drift samples, drift %.3f ppm", drift_count, state.drift * 1e6);
+
 	sync_fp(0); // initial sync from FP
 
-	while (running == 1)
-	{ // Never ending loop of the daemon.
+	/* Daemon handles SIGINT/SIGTERM/SIGHUP and the update timer in one loop */
+	int exit_code = EXIT_SUCCESS;
+	if (setup_event_loop() < 0)
+	{
+		syslog(LOG_ERR, "Can not set up event loop of %s", app_name);
+		running = 0;
+		exit_code = EXIT_FAILURE;
+	}
+	else
+	{
+		setup_control_socket();
+		status_open();
+		// The time is restored, services waiting for a valid clock may start.
+		notify("READY=1");
 		write_fp(-1);
-		sleep(delay);
+		status_publish();
 	}
 
+	rtc_release();
+	log_async = 1;
+	run_event_loop();
+	notify("STOPPING=1");
+	log_async = 0;
+	log_flush();
+	ram_log_close();
+	status_close();
+	close_control_socket();
+	close_event_loop();
+	rtc_close();
+
 	// Close log file, when it is used.
 	if (log_stream != stdout)
 	{
 		fclose(log_stream);
 	}
 
+	notify_close();
+
 	// Write system log and close it.
 	syslog(LOG_INFO, "Stopped %s", app_name);
 	closelog();
 
 	clean();
 
-	return EXIT_SUCCESS;
+	return exit_code;
 }
@@ -0,0 +1,106 @@
+/*
+ * FPClock (c) 2023 jbleyel
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+Status page published by the fpclock daemon in shared memory.
+
+Readers map FPCLOCK_STATUS_PATH once and take consistent snapshots without
+any syscall:
+
+	const struct fpclock_status *shm = fpclock_status_map();
+	struct fpclock_status st;
+	if (shm && fpclock_status_read(shm, &st) == 0)
+		printf("drift %.3f ppm\n", st.drift_ppm);
+*/
+
+#ifndef FPCLOCK_STATUS_H
+#define FPCLOCK_STATUS_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FPCLOCK_STATUS_PATH "/dev/shm/fpclock.status"
+#define FPCLOCK_STATUS_MAGIC 0x54535046 // "FPST"
+#define FPCLOCK_STATUS_VERSION 1
+
+/**
+ * \brief Daemon status, guarded by a sequence lock
+ */
+struct fpclock_status
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;			 // odd while the daemon is updating
+	uint32_t pid;			 // daemon pid
+	int64_t rtc_time;		 // last RTC reading, epoch
+	double rtc_read_at;		 // system time of that reading
+	double offset;			 // RTC minus system time at the last measurement, seconds
+	double drift_ppm;		 // fitted drift, positive if the RTC runs fast
+	double last_write;		 // system time of the last RTC write, 0 = none yet
+	double next_update;		 // system time of the next scheduled update
+	uint64_t writes_issued;	 // RTC writes issued
+	uint64_t writes_skipped; // RTC writes skipped because the RTC was within tolerance
+	uint32_t samples;		 // drift samples
+	uint32_t reserved;
+	char backend[16]; // RTC backend name
+};
+
+/**
+ * \brief Map the status page read-only
+ * \return   status page or NULL if the daemon does not publish one
+ */
+static inline const struct fpclock_status *fpclock_status_map(void)
+{
+	int fd = open(FPCLOCK_STATUS_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	void *p = mmap(NULL, sizeof(struct fpclock_status), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return p == MAP_FAILED ? NULL : (const struct fpclock_status *)p;
+}
+
+/**
+ * \brief Take a consistent snapshot of the status page
+ * \param    shm   mapped status page
+ * \param    out   snapshot
+ * \return   0 on success, -1 if the page is invalid or stays locked (writer died)
+ */
+static inline int fpclock_status_read(const struct fpclock_status *shm, struct fpclock_status *out)
+{
+	for (int tries = 0;; tries++)
+	{
+		if (tries == 100000)
+			return -1;
+		uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue; // writer active
+		memcpy(out, (const void *)shm, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+	if (out->magic != FPCLOCK_STATUS_MAGIC || out->version != FPCLOCK_STATUS_VERSION)
+		return -1;
+	return 0;
+}
+
+#endif
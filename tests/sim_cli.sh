@@ -0,0 +1,49 @@
+#!/bin/sh
+# Drive the fpclock command line against the simulated RTC backend.
+
+FPCLOCK=${FPCLOCK:-../src/fpclock}
+
+# A running daemon would take -p/-f/-u over its control socket and its real RTC.
+if [ -S /var/run/fpclock.sock ]; then
+	echo "fpclock daemon running, skipped"
+	exit 77
+fi
+
+tmp=$(mktemp -d /tmp/fpclock-cli.XXXXXX) || exit 99
+trap 'rm -rf "$tmp"' EXIT
+rtc="sim:$tmp/rtc"
+failures=0
+
+fail()
+{
+	echo "FAIL: $*"
+	failures=$((failures + 1))
+}
+
+# -f writes the RTC, -p reads it back
+"$FPCLOCK" -b "$rtc" -f 1700000000 || fail "force write"
+TZ=UTC "$FPCLOCK" -b "$rtc" -p | grep -q "Nov 14 22:13:2. 2023" || fail "read back forced time"
+
+# injected faults are retried once, the RTC contents survive them
+ok=0
+for seed in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	if TZ=UTC FPCLOCK_SIM_FAIL=50 FPCLOCK_SIM_SEED=$seed "$FPCLOCK" -b "$rtc" -p | grep -q "2023"; then
+		ok=$((ok + 1))
+	fi
+done
+[ $ok -ge 12 ] || fail "only $ok of 20 reads with 50% faults succeeded"
+
+# access latency is measured
+min=$(FPCLOCK_SIM_LATENCY=5 "$FPCLOCK" -b "$rtc" -S | sed -n 's/.*read latency n:[0-9]* min:\([0-9.]*\).*/\1/p')
+awk -v m="$min" 'BEGIN { exit !(m >= 5 && m < 50) }' || fail "read latency min '$min' ms, expected 5"
+
+# -u writes the system time, -R leaves a clock within 30 seconds alone
+"$FPCLOCK" -b "$rtc" -u || fail "update"
+FPCLOCK_BACKEND=$rtc "$FPCLOCK" -R || fail "fast restore of an RTC in sync"
+
+# an unknown backend is an error, not a crash
+FPCLOCK_BACKEND=bogus "$FPCLOCK" -R 2>/dev/null
+rc=$?
+[ $rc -eq 1 ] || fail "fast restore with an unknown backend returned $rc"
+
+[ $failures -eq 0 ]
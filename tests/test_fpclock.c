@@ -0,0 +1,413 @@
+/*
+ * FPClock (c) 2023 jbleyel
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/*
+Tests of the daemon internals against the simulated RTC (sim:@).
+
+fpclock.c is included with the system clock calls replaced, so restores are
+recorded instead of changing the clock, and the drift state is redirected
+to a temporary directory.
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/timex.h>
+#include <time.h>
+
+static int steps = 0;
+static double stepped = 0;
+
+static int test_clock_settime(clockid_t clk, const struct timespec *ts)
+{
+	struct timespec now;
+	clock_gettime(clk, &now);
+	stepped = (double)(ts->tv_sec - now.tv_sec) + (double)(ts->tv_nsec - now.tv_nsec) / 1e9;
+	steps++;
+	return 0;
+}
+
+static int test_clock_adjtime(clockid_t clk, struct timex *tx)
+{
+	stepped = (double)tx->offset / 1e6;
+	steps++;
+	return 0;
+}
+
+#define clock_settime test_clock_settime
+#define clock_adjtime test_clock_adjtime
+#define main fpclock_main
+#include "fpclock.c"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                                           \
+	do                                                                                             \
+	{                                                                                              \
+		if (!(cond))                                                                               \
+		{                                                                                          \
+			printf("FAIL %s:%d: ", __func__, __LINE__);                                            \
+			printf(__VA_ARGS__);                                                                   \
+			printf("\n");                                                                          \
+			failures++;                                                                            \
+		}                                                                                          \
+	} while (0)
+
+/**
+ * \brief Select the in-memory simulator with the given fault injection
+ */
+static void sim_setup(const char *fail, const char *seed)
+{
+	if (fail)
+		setenv("FPCLOCK_SIM_FAIL", fail, 1);
+	else
+		unsetenv("FPCLOCK_SIM_FAIL");
+	if (seed)
+		setenv("FPCLOCK_SIM_SEED", seed, 1);
+	rtc_sim.configured = 0;
+	rtc_sim.fail_pct = 0;
+	rtc_reset();
+}
+
+/**
+ * \brief Let the simulated RTC run at drift_ppm since it was set to now - ago
+ */
+static void sim_history(double ago)
+{
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), "%.6f %.6f\n", clock_now(CLOCK_REALTIME) - ago,
+					   sim_boottime() - ago);
+	if (rtc_open() == 0 && pwrite(rtc_fd, buf, len, 0) == len)
+		CHECK(ftruncate(rtc_fd, len) == 0, "truncate simulator");
+	rtc_phase_at = 0; // moved behind the phase tracking
+}
+
+static void test_restore_sign_and_threshold(void)
+{
+	sim_setup(NULL, NULL);
+	precise = 0;
+
+	CHECK(rtc_write(time(NULL) + 100) == 0, "write RTC");
+	steps = 0;
+	CHECK(sync_fp(1) == 1, "RTC 100 s ahead is corrected");
+	CHECK(steps == 1 && fabs(stepped - 100) < 2, "correction %.3f, expected +100", stepped);
+
+	CHECK(rtc_write(time(NULL) - 100) == 0, "write RTC");
+	steps = 0;
+	CHECK(sync_fp(1) == 1, "RTC 100 s behind is corrected");
+	CHECK(steps == 1 && fabs(stepped + 100) < 2, "correction %.3f, expected -100", stepped);
+
+	CHECK(rtc_write(time(NULL) + 10) == 0, "write RTC");
+	steps = 0;
+	CHECK(sync_fp(1) == 0 && steps == 0, "10 s is below the restore threshold");
+}
+
+static void test_drift_convergence(void)
+{
+	const double drift = 12e-6;
+
+	// synthetic samples with noise and one outlier
+	drift_count = drift_index = 0;
+	for (int i = 0; i < 40; i++)
+		add_drift(drift * 3600 + ((i * 7) % 11 - 5) * 0.001, 3600);
+	add_drift(5.0, 3600);
+	CHECK(fabs(calc_drift() - drift) < 0.2e-6, "fitted %.3f ppm, expected 12", calc_drift() * 1e6);
+
+	// measured from the simulator running 50 ppm fast for an hour
+	sim_setup(NULL, NULL);
+	setenv("FPCLOCK_SIM_DRIFT", "50", 1);
+	rtc_sim.configured = 0;
+	rtc_reset();
+	drift_count = drift_index = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		sim_history(3600);
+		rtc_last_write = clock_now(CLOCK_REALTIME) - 3600;
+		rtc_write_offset = 0;
+		updateRTC(1, 0);
+	}
+	unsetenv("FPCLOCK_SIM_DRIFT");
+	rtc_sim.drift_ppm = 0;
+	CHECK(drift_count == 3, "%d samples, expected 3", drift_count);
+	CHECK(fabs(calc_drift() - 50e-6) < 3e-6, "fitted %.3f ppm, expected 50", calc_drift() * 1e6);
+}
+
+static void test_drift_temperature_groups(void)
+{
+	// -0.034 ppm/C^2 around 25 C, 12 samples running warm and 5 in standby
+	drift_count = drift_index = 0;
+	for (int i = 0; i < 18; i++)
+	{
+		double temp = i < 12 ? 48 + (i % 5) : 29 + (i % 3);
+		double drift = -0.034e-6 * (temp - 25) * (temp - 25);
+		if (i == 17)
+			drift += 200e-6; // one outlier
+		add_drift(drift * 3600, 3600);
+		drift_data[(drift_index + DRIFT_SAMPLES - 1) % DRIFT_SAMPLES].temp = temp;
+	}
+	struct drift_model m;
+	calc_drift_model(&m);
+	CHECK(m.order == 3 && m.tmin == 29 && m.tmax == 52,
+		  "order %d over %.0f..%.0f C, expected 3 over 29..52", m.order, m.tmin, m.tmax);
+	CHECK(fabs(drift_model_at(&m, 25)) < 0.5e-6, "drift at 25 C %.3f ppm, expected 0",
+		  drift_model_at(&m, 25) * 1e6);
+	CHECK(fabs(drift_model_at(&m, 50) + 21.25e-6) < 0.5e-6,
+		  "drift at 50 C %.3f ppm, expected -21.25", drift_model_at(&m, 50) * 1e6);
+	drift_count = drift_index = 0;
+}
+
+static void test_resume_seen_by_rtc(void)
+{
+	struct event_source src = {-1, on_clock_step};
+	uint64_t one = 1;
+	char buf[64];
+	time_t t;
+	int pipe_fd[2];
+
+	sim_setup(NULL, NULL);
+	drift_count = drift_index = 0;
+	CHECK(pipe(pipe_fd) == 0 && rtc_write(time(NULL)) == 0, "pipe and RTC");
+	src.fd = pipe_fd[0];
+
+	// 100 s of suspend that CLOCK_BOOTTIME did not see, the RTC kept counting
+	int len = snprintf(buf, sizeof(buf), "%.6f %.6f\n", clock_now(CLOCK_REALTIME) + 100,
+					   sim_boottime());
+	CHECK(pwrite(rtc_fd, buf, len, 0) == len && ftruncate(rtc_fd, len) == 0, "advance RTC");
+	steps = 0;
+	CHECK(write(pipe_fd[1], &one, sizeof(one)) == sizeof(one), "signal clock step");
+	on_clock_step(&src, EPOLLIN);
+	CHECK(steps == 1 && fabs(stepped - 100) < 2, "restored %.3f after resume, expected +100",
+		  stepped);
+	CHECK(rtc_read(&t) == 0 && labs((long)(t - time(NULL)) - 100) <= 1,
+		  "RTC kept its time, %ld s ahead", (long)(t - time(NULL)));
+
+	// a plain clock step writes the system time to the RTC
+	CHECK(write(pipe_fd[1], &one, sizeof(one)) == sizeof(one), "signal clock step");
+	on_clock_step(&src, EPOLLIN);
+	CHECK(rtc_read(&t) == 0 && labs((long)(t - time(NULL))) <= 1,
+		  "RTC written after a clock step, %ld s off", (long)(t - time(NULL)));
+	close(pipe_fd[0]);
+	close(pipe_fd[1]);
+}
+
+static void test_write_threshold(void)
+{
+	sim_setup(NULL, NULL);
+	updateRTC(0, 0); // aligned write
+	write_threshold = 0.5;
+	unsigned long issued = rtc_writes_issued, skipped = rtc_writes_skipped;
+	updateRTC(1, 0);
+	CHECK(rtc_writes_skipped == skipped + 1 && rtc_writes_issued == issued,
+		  "RTC within threshold is not written");
+
+	CHECK(rtc_write(time(NULL) + 5) == 0, "write RTC");
+	updateRTC(1, 0);
+	CHECK(rtc_writes_issued == issued + 1, "RTC 5 s off is written");
+	write_threshold = 0;
+}
+
+static void test_retry_on_eio(void)
+{
+	time_t now = time(NULL), t;
+	int ok = 0, wrong = 0;
+
+	sim_setup(NULL, NULL);
+	CHECK(rtc_write(now) == 0, "write RTC");
+	sim_setup("50", "7");
+	unsigned long errors = rtc_read_errors;
+	for (int i = 0; i < 400; i++)
+	{
+		if (rtc_read(&t) == 0)
+		{
+			ok++;
+			if (llabs((long long)(t - now)) > 5)
+				wrong++;
+		}
+	}
+	// one attempt succeeds half the time, with the retry three quarters
+	CHECK(ok > 260, "%d of 400 reads succeeded", ok);
+	CHECK(wrong == 0, "%d reads returned a wrong time after a fault", wrong);
+	CHECK(rtc_read_errors > errors, "injected faults are counted");
+	sim_setup(NULL, NULL);
+}
+
+static void test_state_crc(const char *dir)
+{
+	char flash[256], shadow[256];
+	struct state_file hdr;
+
+	snprintf(flash, sizeof(flash), "%s/fpclock.drift", dir);
+	snprintf(shadow, sizeof(shadow), "%s/fpclock.shadow", dir);
+	drift_file = flash;
+	shadow_file = shadow;
+
+	drift_count = drift_index = 0;
+	for (int i = 0; i < 10; i++)
+		add_drift(20e-6 * 3600, 3600);
+	rtc_last_write = clock_now(CLOCK_REALTIME);
+	CHECK(save_state(1) == 0, "save state");
+	CHECK(load_state(&hdr, 0) == 0 && hdr.count == 10, "load saved state");
+
+	// offline drift of a fast RTC is subtracted
+	double corr = get_drift_seconds((int)hdr.last_write + 100000);
+	CHECK(fabs(corr + 2.0) < 0.01, "drift correction %.3f, expected -2", corr);
+
+	// flip a bit in the samples of the flash copy
+	int fd = open(flash, O_RDWR);
+	char c;
+	CHECK(fd >= 0 && pread(fd, &c, 1, sizeof(hdr) + 4) == 1, "read flash copy");
+	c ^= 1;
+	CHECK(pwrite(fd, &c, 1, sizeof(hdr) + 4) == 1, "corrupt flash copy");
+	close(fd);
+	CHECK(load_state(&hdr, 0) == 0, "valid shadow copy is used");
+	unlink(shadow);
+	CHECK(load_state(&hdr, 0) < 0, "corrupt flash copy is rejected");
+	unlink(flash);
+}
+
+static void test_flash_staleness(const char *dir)
+{
+	char flash[256], shadow[256];
+
+	snprintf(flash, sizeof(flash), "%s/fpclock.drift", dir);
+	snprintf(shadow, sizeof(shadow), "%s/fpclock.shadow", dir);
+	drift_file = flash;
+	shadow_file = shadow;
+
+	drift_count = drift_index = 0;
+	for (int i = 0; i < 10; i++)
+		add_drift(20e-6 * 3600, 3600);
+	rtc_last_write = clock_now(CLOCK_REALTIME);
+	CHECK(save_state(1) == 0, "save state");
+	uint32_t writes = state_flash_writes;
+
+	// 20 ppm for 5000 s is 0.1 s, within flash_offset: shadow only
+	rtc_last_write += 5000;
+	maybe_save_state();
+	CHECK(state_flash_writes == writes, "flash written after 0.1 s of stale drift");
+
+	// 20000 s is 0.4 s, the flash copy must follow
+	rtc_last_write += 15000;
+	maybe_save_state();
+	CHECK(state_flash_writes == writes + 1, "flash not written after 0.4 s of stale drift");
+	unlink(flash);
+	unlink(shadow);
+}
+
+static int count_text(const char *buf, const char *text)
+{
+	int n = 0;
+	for (const char *p = buf; (p = strstr(p, text)); p++)
+		n++;
+	return n;
+}
+
+static void test_log_write_failure(const char *dir)
+{
+	char path[256], ram_path[256], buf[4096];
+	FILE *full = fopen("/dev/full", "w");
+	FILE *out;
+
+	snprintf(path, sizeof(path), "%s/fpclock.log", dir);
+	snprintf(ram_path, sizeof(ram_path), "%s/ram.log", dir);
+	ram_log_file = ram_path;
+	ram_log_kb = 4;
+	CHECK(full && ram_log_open() == 0, "open /dev/full and the RAM log");
+	if (!full || !ram_log)
+		return;
+
+	log_stream = full;
+	log_async = 1;
+	LOG(LOG_WARN, "first warning");
+	LOG(0, "plain line");
+	log_flush();
+	CHECK(log_tail != log_head, "failed write keeps the records queued");
+
+	out = fopen(path, "w+");
+	log_stream = out;
+	log_flush();
+	log_async = 0;
+	CHECK(log_tail == log_head, "queue drained after the write succeeds");
+	size_t len = pread(fileno(out), buf, sizeof(buf) - 1, 0);
+	buf[len < sizeof(buf) ? len : 0] = 0;
+	CHECK(count_text(buf, "first warning") == 1 && count_text(buf, "plain line") == 0,
+		  "file has the warning once:\n%s", buf);
+	len = ram_log->head < sizeof(buf) - 1 ? ram_log->head : sizeof(buf) - 1;
+	memcpy(buf, ram_log->data, len);
+	buf[len] = 0;
+	CHECK(count_text(buf, "first warning") == 1 && count_text(buf, "plain line") == 1,
+		  "RAM log has each line once:\n%s", buf);
+
+	log_stream = stdout;
+	fclose(out);
+	fclose(full);
+	ram_log_close();
+	unlink(path);
+	unlink(ram_path);
+}
+
+static void test_control_client_gone(const char *dir)
+{
+	struct sockaddr_un addr;
+	struct event_source src = {-1, on_control};
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/fpclock.sock", dir);
+	src.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	CHECK(src.fd >= 0 && bind(src.fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+			  listen(src.fd, 1) == 0,
+		  "listen on %s", addr.sun_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	CHECK(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+			  write(fd, "get-status\n", 11) == 11,
+		  "send command");
+	close(fd); // gone before the reply, a SIGPIPE would end the test here
+	on_control(&src, EPOLLIN);
+	CHECK(1, "daemon survives a client that closed early");
+	close(src.fd);
+	unlink(addr.sun_path);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/fpclock-test.XXXXXX";
+
+	log_stream = stdout;
+	if (!mkdtemp(dir))
+		return 99;
+	rtc_backend_name = strdup("sim:@");
+
+	test_restore_sign_and_threshold();
+	test_drift_convergence();
+	test_drift_temperature_groups();
+	test_write_threshold();
+	test_resume_seen_by_rtc();
+	test_retry_on_eio();
+	test_state_crc(dir);
+	test_flash_staleness(dir);
+	test_log_write_failure(dir);
+	test_control_client_gone(dir);
+
+	rmdir(dir);
+	rtc_close();
+	if (failures)
+		printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}